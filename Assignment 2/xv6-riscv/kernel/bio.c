@@ -1,13 +1,21 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// The buffers and their data live in pages from kalloc().
+// The cache starts with NBUF buffers and grows on demand, up
+// to 1/BCACHEFRAC of the memory free at boot; when kalloc()
+// runs out of pages it calls bshrink() to give unused
+// buffers back.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * To have a block read into the cache for later, call breadahead.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritev to write several buffers at once.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -23,33 +31,216 @@
 #include "fs.h"
 #include "buf.h"
 
+// Buffers are hashed by (dev, blockno) into buckets, each a
+// list with its own lock, so lookups of different blocks
+// don't contend. binit() allocates the buckets in pages from
+// kalloc(), BBUCKETLOAD buffers to a bucket when the cache is
+// full, so chains stay short. Buffers that hold no block are
+// on bcache.free. Otherwise an unused buffer is recycled with
+// the clock algorithm, giving a second chance to buffers
+// used since the clock hand last passed.
+#define BBUCKETLOAD 3   // buffers per hash bucket in a full cache
+#define NBPAGE      64  // most pages of hash buckets
+
+// A page of buffers, as allocated from kalloc(). Their data
+// is in separate pages, BPERDPAGE blocks to a page, so that
+// little of either kind of page goes unused.
+struct bchunk {
+  struct bchunk *next;
+  struct buf buf[];   // BPERCHUNK of them
+};
+#define BPERDPAGE (PGSIZE / BSIZE)
+#define BPERCHUNK ((PGSIZE - sizeof(struct bchunk *)) / sizeof(struct buf) \
+                   / BPERDPAGE * BPERDPAGE)
+#define PPERCHUNK (1 + BPERCHUNK / BPERDPAGE)  // pages in all
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;  // list of buffers, through prev/next
+};
+#define BKPERPAGE (PGSIZE / sizeof(struct bucket))
+
 struct {
+  // lock serializes recycling, growing and shrinking,
+  // and protects the fields below.
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct bchunk *chunks;  // all pages of buffers
+  struct buf *free;       // buffers that hold no block
+  int nbuf;               // buffers in the cache
+  int maxbuf;             // grow no larger than this
+  int lowater;            // don't grow below this many free pages
+  struct bchunk *hand;    // clock hand: chunk and index
+  int handi;
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bucket *bucket[NBPAGE];  // pages of hash buckets
+  int nbucket;
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  uint i = (dev * 31 + blockno) % bcache.nbucket;
+
+  return &bcache.bucket[i / BKPERPAGE][i % BKPERPAGE];
+}
+
+// Push b on the list at *head.
+static void
+blink(struct buf **head, struct buf *b)
+{
+  b->next = *head;
+  b->prev = 0;
+  if(*head)
+    (*head)->prev = b;
+  *head = b;
+}
+
+// Remove b from the list at *head.
+static void
+bunlink(struct buf **head, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    *head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+// Return the cached buffer for block on device dev in bk
+// with its refcnt raised, or 0 if it isn't cached.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      b->used = 1;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Add a page of buffers, and the pages for their data,
+// to the cache. Returns 0 if out of memory.
+// Caller must hold bcache.lock.
+static int
+bgrow(void)
+{
+  struct bchunk *c;
+  struct buf *b;
+  char *data = 0;
+  int i;
+
+  if((c = (struct bchunk*)kalloc()) == 0)
+    return 0;
+  for(i = 0; i < BPERCHUNK; i++){
+    if(i % BPERDPAGE == 0 && (data = kalloc()) == 0){
+      for(i -= BPERDPAGE; i >= 0; i -= BPERDPAGE)
+        kfree((char*)c->buf[i].data);
+      kfree((char*)c);
+      return 0;
+    }
+    c->buf[i].data = (uchar*)data + i % BPERDPAGE * BSIZE;
+  }
+  for(b = c->buf; b < c->buf+BPERCHUNK; b++){
+    initsleeplock(&b->lock, "buffer");
+    b->refcnt = 0;
+    b->hashed = 0;
+    blink(&bcache.free, b);
+  }
+  c->next = bcache.chunks;
+  bcache.chunks = c;
+  bcache.nbuf += BPERCHUNK;
+  return 1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  int nfree, i;
+
+  if(BPERCHUNK < 1)
+    panic("binit: buf too large");
 
   initlock(&bcache.lock, "bcache");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  nfree = kfreepages();
+  bcache.maxbuf = nfree / BCACHEFRAC / PPERCHUNK * BPERCHUNK;
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
+  bcache.lowater = nfree / (2*BCACHEFRAC);
+
+  bcache.nbucket = bcache.maxbuf / BBUCKETLOAD + 1;
+  if(bcache.nbucket > NBPAGE * BKPERPAGE){
+    bcache.nbucket = NBPAGE * BKPERPAGE;
+    bcache.maxbuf = bcache.nbucket * BBUCKETLOAD;
+  }
+  for(i = 0; i < bcache.nbucket; i++){
+    if(i % BKPERPAGE == 0 &&
+       (bcache.bucket[i / BKPERPAGE] = (struct bucket*)kalloc()) == 0)
+      panic("binit: buckets");
+    bk = &bcache.bucket[i / BKPERPAGE][i % BKPERPAGE];
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head = 0;
   }
+
+  acquire(&bcache.lock);
+  while(bcache.nbuf < NBUF){
+    if(bgrow() == 0)
+      panic("binit");
+  }
+  release(&bcache.lock);
+}
+
+// Advance the clock hand to the next buffer and return it.
+// Caller must hold bcache.lock.
+static struct buf*
+bclock(void)
+{
+  if(bcache.hand == 0 || ++bcache.handi >= BPERCHUNK){
+    bcache.hand = bcache.hand ? bcache.hand->next : 0;
+    if(bcache.hand == 0)
+      bcache.hand = bcache.chunks;
+    bcache.handi = 0;
+  }
+  return &bcache.hand->buf[bcache.handi];
+}
+
+// Take an unused buffer out of its hash bucket so it can
+// cache another block, choosing it with the clock algorithm.
+// Returns 0 if every buffer is in use.
+// Caller must hold bcache.lock.
+static struct buf*
+bevict(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int i;
+
+  // two sweeps: the first may only clear used bits.
+  for(i = 0; i < 2*bcache.nbuf; i++){
+    b = bclock();
+    if(!b->hashed)
+      continue;
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0 && !b->used){
+      bunlink(&bk->head, b);
+      b->hashed = 0;
+      release(&bk->lock);
+      return b;
+    }
+    if(b->refcnt == 0)
+      b->used = 0;
+    release(&bk->lock);
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -59,33 +250,53 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached. Only one process at a time may recycle,
+  // so check again in case another just cached the block.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+  release(&bk->lock);
+
+  // Use a buffer that holds no block, growing the cache
+  // if memory allows, or else recycle an unused one.
+  if(bcache.free == 0 && bcache.nbuf < bcache.maxbuf &&
+     kfreepages() > bcache.lowater)
+    bgrow();
+  if((b = bcache.free) != 0)
+    bunlink(&bcache.free, b);
+  else if((b = bevict()) == 0)
+    panic("bget: no buffers");
+
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->used = 1;
+  b->hashed = 1;
+  acquire(&bk->lock);
+  blink(&bk->head, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +313,28 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading the n indicated blocks into the cache, those
+// that aren't there, without waiting for the disk. A later
+// bread() of a block waits for its read, if still going.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *b;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b = bget(dev, blocknos[i]);
+    if(b->valid || virtio_disk_start(b, 0, 1) < 0){
+      brelse(b);
+      continue;
+    }
+    // the disk now holds our reference to b, and drops
+    // it when the read finishes; see virtio_disk_intr().
+    releasesleep(&b->lock);
+  }
+  virtio_disk_kick();
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +344,115 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the contents of n locked buffers to disk, letting
+// the disk work on all of them at once. Sorts bs by block
+// number, so that runs of consecutive blocks go to the disk
+// as single requests.
+void
+bwritev(struct buf **bs, int n)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+    b = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > b->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+  virtio_disk_startv(bs, n);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Called by kalloc() when it runs out of pages: give back
+// pages of buffers that are all unused, keeping at least
+// NBUF buffers. Unused buffers are clean, so their blocks
+// can simply be dropped. Returns the number of pages freed.
+int
+bshrink(void)
+{
+  struct bchunk *c, **pc;
+  struct buf *b;
+  struct bucket *bk;
+  int nfreed = 0, nidle;
+
+  // kalloc() may be called from bget() itself while growing.
+  if(holding(&bcache.lock))
+    return 0;
 
+  acquire(&bcache.lock);
+  pc = &bcache.chunks;
+  while((c = *pc) != 0 && bcache.nbuf - (int)BPERCHUNK >= NBUF){
+    // drop the chunk's unused blocks from the hash table.
+    nidle = 0;
+    for(b = c->buf; b < c->buf+BPERCHUNK; b++){
+      if(b->hashed){
+        bk = bhash(b->dev, b->blockno);
+        acquire(&bk->lock);
+        if(b->refcnt == 0){
+          bunlink(&bk->head, b);
+          b->hashed = 0;
+          blink(&bcache.free, b);
+        }
+        release(&bk->lock);
+      }
+      if(!b->hashed)
+        nidle++;
+    }
+    if(nidle < (int)BPERCHUNK){
+      pc = &c->next;
+      continue;
+    }
+
+    for(b = c->buf; b < c->buf+BPERCHUNK; b++)
+      bunlink(&bcache.free, b);
+    *pc = c->next;
+    if(bcache.hand == c)
+      bcache.hand = 0;
+    bcache.nbuf -= BPERCHUNK;
+    for(b = c->buf; b < c->buf+BPERCHUNK; b += BPERDPAGE)
+      kfree((char*)b->data);
+    kfree((char*)c);
+    nfreed += PPERCHUNK;
+  }
+  release(&bcache.lock);
+  return nfreed;
+}
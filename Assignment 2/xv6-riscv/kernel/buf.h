@@ -5,8 +5,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int used;         // used since the clock hand passed?
+  int hashed;       // in a hash bucket, rather than bcache.free?
+  struct buf *prev; // hash bucket or free list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
 };
 
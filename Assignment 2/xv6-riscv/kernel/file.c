@@ -76,7 +76,7 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_op(OPPUT);
     iput(ff.ip);
     end_op();
   }
@@ -146,18 +146,18 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
+    // write up to half the log at a time to avoid exceeding
     // the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (log_size()/2 - OPWRITE(0)) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_op(OPWRITE(n1));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -178,3 +178,70 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Move up to n bytes from file in to file out, without
+// copying them through user space: from an inode into a pipe,
+// with readi() straight into the pipe's buffer, or from a pipe
+// into an inode, with writei() straight out of it.
+// Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  struct pipe *pi;
+  char *p;
+  int i = 0, m, r = 0, max;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  if(in->type == FD_INODE && out->type == FD_PIPE){
+    pi = out->pipe;
+    while(i < n){
+      if((m = pipewbegin(pi, &p)) < 0){
+        r = -1;
+        break;
+      }
+      if(m > n - i)
+        m = n - i;
+      ilock(in->ip);
+      if((r = readi(in->ip, 0, (uint64)p, in->off, m)) > 0)
+        in->off += r;
+      iunlock(in->ip);
+      pipewend(pi, r > 0 ? r : 0);
+      if(r <= 0)
+        break;
+      i += r;
+    }
+  } else if(in->type == FD_PIPE && out->type == FD_INODE){
+    // like filewrite(), a transaction per part, but only
+    // wait for the pipe to fill before the first.
+    pi = in->pipe;
+    max = (log_size()/2 - OPWRITE(0)) * BSIZE;
+    while(i < n){
+      if((m = piperbegin(pi, &p, i == 0)) <= 0){
+        r = m;
+        break;
+      }
+      if(m > n - i)
+        m = n - i;
+      if(m > max)
+        m = max;
+      begin_op(OPWRITE(m));
+      ilock(out->ip);
+      if((r = writei(out->ip, 0, (uint64)p, out->off, m)) > 0)
+        out->off += r;
+      iunlock(out->ip);
+      end_op();
+      piperend(pi, r > 0 ? r : 0);
+      if(r != m){
+        // error from writei
+        r = -1;
+        break;
+      }
+      i += r;
+    }
+  } else {
+    return -1;
+  }
+
+  return (i == 0 && r < 0) ? -1 : i;
+}
@@ -18,15 +18,29 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int used;           // used since the clock hand passed?
+  int hashed;         // in a hash bucket, rather than itable.free?
+  struct inode *prev; // hash bucket or free list
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ralast;        // last block read, to detect sequential reads
+  uint ranext;        // next block to read ahead
+  uint lastb;         // block last allocated to it, or 0
 
   short type;         // copy of disk inode
+  short flags;        // I_EXTENT bit of the disk inode's type
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+3];
+
+  uint xlbn;          // extent last used by bmap(), an extent
+  uint xstart;        //   inode's blocks xlbn..xlbn+xlen-1
+  uint xlen;
+  int indi;           // indirect block last used by bmap() under
+  uint inda;          //   the double-indirect block: index, address
 };
 
 // map major device number to device functions.
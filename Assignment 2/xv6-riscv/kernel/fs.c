@@ -37,6 +37,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bcount(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +46,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bcount(dev);
   ireclaim(dev);
 }
 
@@ -60,27 +63,101 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The allocator keeps the number of free blocks each free map
+// block describes, so it can skip full ones, and looks for
+// free blocks 64 at a time. It starts looking at a goal
+// block: the one after the block last allocated to the same
+// inode, or after the block last allocated at all. The free
+// counts change only with the free map block locked.
+
+#define NBMAP (FSSIZE/BPB + 1)   // free map blocks with counts
+
+static int bnfree[NBMAP];  // free blocks per free map block
+static uint bnext;         // after the block last allocated
+
+// Index of the lowest set bit of x, which must not be 0.
+static int
+ctz64(uint64 x)
+{
+  static const uchar debruijn[64] = {
+     0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+    62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+    63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+    51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12,
+  };
+  return debruijn[((x & -x) * 0x022fdd63cc95386dULL) >> 58];
+}
+
+// Count the free blocks each free map block describes.
+static void
+bcount(int dev)
+{
+  int i, bi;
+  struct buf *bp;
+
+  for(i = 0; i < NBMAP && i*BPB < sb.size; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    bnfree[i] = 0;
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bnfree[i]++;
+    brelse(bp);
+  }
+}
 
-// Allocate a zeroed disk block.
+// Mark block b in the locked free map block bp in use (used=1)
+// or free (used=0).
+static void
+bmark(struct buf *bp, uint b, int used)
+{
+  int bi = b % BPB;
+
+  if(used)
+    bp->data[bi/8] |= 1 << (bi % 8);
+  else
+    bp->data[bi/8] &= ~(1 << (bi % 8));
+  if(b/BPB < NBMAP)
+    bnfree[b/BPB] += used ? -1 : 1;
+  log_write(bp);
+}
+
+// Allocate a zeroed disk block, the first free one at or
+// after goal, wrapping around to the start of the disk.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  int i, n, wi, wstart;
+  uint bm, b;
+  uint64 *w, free;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal >= sb.size)
+    goal = 0;
+  n = (sb.size + BPB - 1) / BPB;
+  // visit goal's free map block twice: last for the blocks before goal.
+  for(i = 0; i <= n; i++){
+    bm = (goal/BPB + i) % n;
+    if(bm < NBMAP && bnfree[bm] == 0)
+      continue;
+    bp = bread(dev, sb.bmapstart + bm);
+    w = (uint64*)bp->data;
+    wstart = i == 0 ? (goal % BPB) / 64 : 0;
+    for(wi = wstart; wi < BPB/64; wi++){
+      free = ~w[wi];
+      if(i == 0 && wi == wstart)
+        free &= ~0ULL << (goal % 64);
+      if(free == 0)
+        continue;
+      b = bm*BPB + wi*64 + ctz64(free);
+      if(b >= sb.size)
+        break;
+      bmark(bp, b, 1);
+      brelse(bp);
+      bzero(dev, b);
+      bnext = b + 1;
+      return b;
     }
     brelse(bp);
   }
@@ -88,6 +165,29 @@ balloc(uint dev)
   return 0;
 }
 
+// Allocate disk block b if it is free, zeroing it.
+// returns 0 if it isn't.
+static uint
+ballocat(uint dev, uint b)
+{
+  int bi;
+  struct buf *bp;
+
+  if(b >= sb.size)
+    return 0;
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  if(bp->data[bi/8] & (1 << (bi % 8))){
+    brelse(bp);
+    return 0;
+  }
+  bmark(bp, b, 1);
+  brelse(bp);
+  bzero(dev, b);
+  bnext = b + 1;
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -100,11 +200,24 @@ bfree(int dev, uint b)
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
-  bp->data[bi/8] &= ~m;
-  log_write(bp);
+  bmark(bp, b, 0);
   brelse(bp);
 }
 
+// Allocate a zeroed disk block for inode ip, near the one
+// last allocated to it.
+// returns 0 if out of disk space.
+static uint
+iballoc(struct inode *ip)
+{
+  uint b;
+
+  b = balloc(ip->dev, ip->lastb ? ip->lastb + 1 : bnext);
+  if(b)
+    ip->lastb = b;
+  return b;
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -131,7 +244,7 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   may be recycled if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
@@ -165,35 +278,215 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table of inodes, keyed by dev and inum,
+// in pages from kalloc(). It starts with NINODE entries and
+// grows on demand, up to 1/ICACHEFRAC of the memory free at
+// boot. An entry with ip->ref zero keeps its inode cached
+// until iget() recycles the entry, choosing it with the clock
+// algorithm as bget() does for buffers; entries holding no
+// inode are on itable.free. iinit() sizes the hash buckets,
+// also in pages from kalloc(), for IBUCKETLOAD entries each
+// when the table is full, so chains stay short.
+//
+// Each hash bucket's spin-lock protects the ip->ref, dev,
+// inum, used and hash links of the entries in the bucket;
+// one must hold it while using any of those fields.
+// itable.lock serializes recycling and growing the table.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define IBUCKETLOAD 3   // entries per hash bucket in a full table
+#define NIBPAGE     32  // most pages of hash buckets
+
+// A page of inodes, as allocated from kalloc().
+struct ichunk {
+  struct ichunk *next;
+  struct inode inode[];   // IPERCHUNK of them
+};
+#define IPERCHUNK ((PGSIZE - sizeof(struct ichunk *)) / sizeof(struct inode))
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;  // list of inodes, through prev/next
+};
+#define IBPERPAGE (PGSIZE / sizeof(struct ibucket))
+
 struct {
+  // lock serializes recycling and growing,
+  // and protects the fields below.
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct ichunk *chunks;  // all pages of inodes
+  struct inode *free;     // entries that hold no inode
+  int ninode;             // entries in the table
+  int maxinode;           // grow no larger than this
+  struct ichunk *hand;    // clock hand: chunk and index
+  int handi;
+
+  struct ibucket *bucket[NIBPAGE];  // pages of hash buckets
+  int nbucket;
 } itable;
 
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  uint i = (dev * 31 + inum) % itable.nbucket;
+
+  return &itable.bucket[i / IBPERPAGE][i % IBPERPAGE];
+}
+
+// Push ip on the list at *head.
+static void
+ilink(struct inode **head, struct inode *ip)
+{
+  ip->next = *head;
+  ip->prev = 0;
+  if(*head)
+    (*head)->prev = ip;
+  *head = ip;
+}
+
+// Remove ip from the list at *head.
+static void
+iunlink(struct inode **head, struct inode *ip)
+{
+  if(ip->prev)
+    ip->prev->next = ip->next;
+  else
+    *head = ip->next;
+  if(ip->next)
+    ip->next->prev = ip->prev;
+}
+
+// Return the table entry for inode inum on device dev in bk
+// with its ref raised, or 0 if it isn't there.
+// Caller must hold bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      ip->ref++;
+      ip->used = 1;
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Add a page of entries to the table.
+// Returns 0 if out of memory.
+// Caller must hold itable.lock.
+static int
+igrow(void)
+{
+  struct ichunk *c;
+  struct inode *ip;
+
+  if((c = (struct ichunk*)kalloc()) == 0)
+    return 0;
+  for(ip = c->inode; ip < c->inode+IPERCHUNK; ip++){
+    initsleeplock(&ip->lock, "inode");
+    ip->ref = 0;
+    ip->hashed = 0;
+    ilink(&itable.free, ip);
+  }
+  c->next = itable.chunks;
+  itable.chunks = c;
+  itable.ninode += IPERCHUNK;
+  return 1;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct ibucket *bk;
+  int i;
+
+  if(IPERCHUNK < 1)
+    panic("iinit: inode too large");
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+
+  itable.maxinode = kfreepages() / ICACHEFRAC * IPERCHUNK;
+  if(itable.maxinode < NINODE)
+    itable.maxinode = NINODE;
+  itable.nbucket = itable.maxinode / IBUCKETLOAD + 1;
+  if(itable.nbucket > NIBPAGE * IBPERPAGE){
+    itable.nbucket = NIBPAGE * IBPERPAGE;
+    itable.maxinode = itable.nbucket * IBUCKETLOAD;
+  }
+  for(i = 0; i < itable.nbucket; i++){
+    if(i % IBPERPAGE == 0 &&
+       (itable.bucket[i / IBPERPAGE] = (struct ibucket*)kalloc()) == 0)
+      panic("iinit: buckets");
+    bk = &itable.bucket[i / IBPERPAGE][i % IBPERPAGE];
+    initlock(&bk->lock, "itable.bucket");
+    bk->head = 0;
+  }
+
+  acquire(&itable.lock);
+  while(itable.ninode < NINODE){
+    if(igrow() == 0)
+      panic("iinit");
+  }
+  release(&itable.lock);
+}
+
+// Advance the clock hand to the next entry and return it.
+// Caller must hold itable.lock.
+static struct inode*
+iclock(void)
+{
+  if(itable.hand == 0 || ++itable.handi >= IPERCHUNK){
+    itable.hand = itable.hand ? itable.hand->next : 0;
+    if(itable.hand == 0)
+      itable.hand = itable.chunks;
+    itable.handi = 0;
+  }
+  return &itable.hand->inode[itable.handi];
+}
+
+// Take an unreferenced entry out of its hash bucket so it can
+// hold another inode, choosing it with the clock algorithm.
+// Returns 0 if every entry is referenced.
+// Caller must hold itable.lock.
+static struct inode*
+ievict(void)
+{
+  struct inode *ip;
+  struct ibucket *bk;
+  int i;
+
+  // two sweeps: the first may only clear used bits.
+  for(i = 0; i < 2*itable.ninode; i++){
+    ip = iclock();
+    if(!ip->hashed)
+      continue;
+    bk = ihash(ip->dev, ip->inum);
+    acquire(&bk->lock);
+    if(ip->ref == 0 && !ip->used){
+      iunlink(&bk->head, ip);
+      ip->hashed = 0;
+      release(&bk->lock);
+      return ip;
+    }
+    if(ip->ref == 0)
+      ip->used = 0;
+    release(&bk->lock);
   }
+  return 0;
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcpurge(uint, uint);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// Files are extent inodes.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
@@ -209,6 +502,8 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if(type == T_FILE)
+        dip->type |= I_EXTENT;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -231,7 +526,7 @@ iupdate(struct inode *ip)
 
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
-  dip->type = ip->type;
+  dip->type = ip->type ? (ip->type | ip->flags) : 0;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
@@ -247,31 +542,48 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  struct ibucket *bk;
 
-  acquire(&itable.lock);
+  bk = ihash(dev, inum);
+  acquire(&bk->lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  if((ip = ifind(bk, dev, inum)) != 0){
+    release(&bk->lock);
+    return ip;
   }
+  release(&bk->lock);
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Not there. Only one process at a time may recycle,
+  // so check again in case another just added the inode.
+  acquire(&itable.lock);
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    release(&bk->lock);
+    release(&itable.lock);
+    return ip;
+  }
+  release(&bk->lock);
+
+  // Use an entry that holds no inode, growing the table
+  // if allowed, or else recycle an unreferenced one.
+  if(itable.free == 0 && itable.ninode < itable.maxinode)
+    igrow();
+  if((ip = itable.free) != 0)
+    iunlink(&itable.free, ip);
+  else if((ip = ievict()) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->used = 1;
+  ip->hashed = 1;
+  acquire(&bk->lock);
+  ilink(&bk->head, ip);
+  release(&bk->lock);
   release(&itable.lock);
 
   return ip;
@@ -282,9 +594,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -304,7 +618,8 @@ ilock(struct inode *ip)
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
+    ip->type = dip->type & ~I_EXTENT;
+    ip->flags = dip->type & I_EXTENT;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
@@ -312,6 +627,11 @@ ilock(struct inode *ip)
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
     ip->valid = 1;
+    ip->ralast = -1;  // so a read of block 0 looks sequential
+    ip->ranext = 0;
+    ip->xlen = 0;
+    ip->indi = -1;
+    ip->lastb = 0;
     if(ip->type == 0)
       panic("ilock: no type");
   }
@@ -337,7 +657,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -346,8 +668,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -355,11 +679,11 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&bk->lock);
   }
 
   ip->ref--;
-  release(&itable.lock);
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -383,7 +707,7 @@ ireclaim(int dev)
     }
     brelse(bp);
     if (ip) {
-      begin_op();
+      begin_op(OPPUT);
       ilock(ip);
       iunlock(ip);
       iput(ip);
@@ -397,7 +721,104 @@ ireclaim(int dev)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// are listed in the NINDIRECT blocks listed in the double-
+// indirect block ip->addrs[NDIRECT+1].
+//
+// An extent inode instead lists extents, runs of consecutive
+// blocks, in file order: NEXTENT in ip->addrs[], and NXEXTENT
+// more in block ip->addrs[XINDIRECT]. A file grows by one block
+// at a time, and its last extent grows with it as long as the
+// next disk block is free.
+
+// Return extent i of inode ip; bp holds ip->addrs[XINDIRECT]
+// if i >= NEXTENT.
+static struct extent*
+xent(struct inode *ip, struct buf *bp, int i)
+{
+  if(i < NEXTENT)
+    return (struct extent*)ip->addrs + i;
+  return (struct extent*)bp->data + (i - NEXTENT);
+}
+
+// Return the disk block address of the nth block in extent
+// inode ip. If bn is the block after the last, xmap
+// allocates it. returns 0 if out of disk space or extents.
+static uint
+xmap(struct inode *ip, uint bn)
+{
+  struct buf *bp = 0;
+  struct extent *x, e = { 0, 0 };
+  uint lbn = 0, addr;
+  int i;
+
+  if(ip->xlen > 0 && bn - ip->xlbn < ip->xlen)
+    return ip->xstart + (bn - ip->xlbn);
+
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if(i == NEXTENT){
+      if(ip->addrs[XINDIRECT] == 0)
+        break;
+      bp = bread(ip->dev, ip->addrs[XINDIRECT]);
+    }
+    x = xent(ip, bp, i);
+    if(x->len == 0)
+      break;
+    if(bn < lbn + x->len){
+      ip->xlbn = lbn;
+      ip->xstart = x->start;
+      ip->xlen = x->len;
+      if(bp)
+        brelse(bp);
+      return ip->xstart + (bn - lbn);
+    }
+    lbn += x->len;
+  }
+
+  // writei() never leaves holes.
+  if(bn != lbn)
+    panic("xmap: hole");
+
+  // grow the last extent if the next disk block is free,
+  // else start a new extent.
+  addr = 0;
+  if(i > 0){
+    x = xent(ip, bp, i-1);
+    if((addr = ballocat(ip->dev, x->start + x->len)) != 0){
+      ip->lastb = addr;
+      x->len++;
+      i--;
+    }
+  }
+  if(addr == 0 && i < NEXTENT + NXEXTENT){
+    if(i >= NEXTENT && bp == 0){
+      if((addr = iballoc(ip)) == 0)
+        return 0;
+      ip->addrs[XINDIRECT] = addr;  // zeroed: no extents yet
+      bp = bread(ip->dev, addr);
+    }
+    if((addr = iballoc(ip)) != 0){
+      x = xent(ip, bp, i);
+      x->start = addr;
+      x->len = 1;
+    }
+  }
+  // x may point into bp; copy it before releasing bp.
+  if(addr)
+    e = *x;
+  if(bp){
+    if(addr && i >= NEXTENT)
+      log_write(bp);
+    brelse(bp);
+  }
+  if(addr == 0)
+    return 0;
+
+  ip->xlbn = bn + 1 - e.len;
+  ip->xstart = e.start;
+  ip->xlen = e.len;
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -408,9 +829,12 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if(ip->flags & I_EXTENT)
+    return xmap(ip, bn);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = iballoc(ip);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -422,7 +846,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = iballoc(ip);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -430,7 +854,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = iballoc(ip);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -439,10 +863,100 @@ bmap(struct inode *ip, uint bn)
     brelse(bp);
     return addr;
   }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Find the indirect block for bn in the double-indirect
+    // block, allocating either if necessary. A sequential
+    // reader or writer uses the same one NINDIRECT times.
+    if(ip->indi == bn / NINDIRECT){
+      addr = ip->inda;
+    } else {
+      if((addr = ip->addrs[NDIRECT+1]) == 0){
+        addr = iballoc(ip);
+        if(addr == 0)
+          return 0;
+        ip->addrs[NDIRECT+1] = addr;
+      }
+      bp = bread(ip->dev, addr);
+      a = (uint*)bp->data;
+      if((addr = a[bn / NINDIRECT]) == 0){
+        addr = iballoc(ip);
+        if(addr){
+          a[bn / NINDIRECT] = addr;
+          log_write(bp);
+        }
+      }
+      brelse(bp);
+      if(addr == 0)
+        return 0;
+      ip->indi = bn / NINDIRECT;
+      ip->inda = addr;
+    }
+
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    if((addr = a[bn % NINDIRECT]) == 0){
+      addr = iballoc(ip);
+      if(addr){
+        a[bn % NINDIRECT] = addr;
+        log_write(bp);
+      }
+    }
+    brelse(bp);
+    return addr;
+  }
 
   panic("bmap: out of range");
 }
 
+// Free the blocks of extent inode ip.
+static void
+xtrunc(struct inode *ip)
+{
+  struct buf *bp = 0;
+  struct extent *x;
+  uint b;
+  int i;
+
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if(i == NEXTENT){
+      if(ip->addrs[XINDIRECT] == 0)
+        break;
+      bp = bread(ip->dev, ip->addrs[XINDIRECT]);
+    }
+    x = xent(ip, bp, i);
+    if(x->len == 0)
+      break;
+    for(b = x->start; b < x->start + x->len; b++)
+      bfree(ip->dev, b);
+  }
+  if(bp)
+    brelse(bp);
+  if(ip->addrs[XINDIRECT])
+    bfree(ip->dev, ip->addrs[XINDIRECT]);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->xlen = 0;
+}
+
+// Free indirect block addr and the blocks it lists.
+static void
+ifree(int dev, uint addr)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -452,6 +966,13 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->flags & I_EXTENT){
+    xtrunc(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -460,16 +981,22 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    ifree(ip->dev, ip->addrs[NDIRECT]);
+    ip->addrs[NDIRECT] = 0;
+  }
+
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        ifree(ip->dev, a[j]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
   }
+  ip->indi = -1;
 
   ip->size = 0;
   iupdate(ip);
@@ -487,6 +1014,39 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the blocks of ip that a sequential reader
+// of block bn will want next, so the disk works while the
+// reader copies data out; see breadahead().
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint end, addr, addrs[NREADAHEAD];
+  int n;
+
+  if(bn != ip->ralast + 1){
+    // not sequential; don't read ahead.
+    ip->ralast = bn;
+    return;
+  }
+  ip->ralast = bn;
+
+  // keep NREADAHEAD blocks in flight ahead of bn, but only
+  // of blocks the file has: bmap() allocates missing ones.
+  end = bn + 1 + NREADAHEAD;
+  if(end > (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE;
+  if(ip->ranext <= bn || ip->ranext > end)
+    ip->ranext = bn + 1;
+  for(n = 0; ip->ranext < end; ip->ranext++){
+    if((addr = bmap(ip, ip->ranext)) == 0)
+      break;
+    addrs[n++] = addr;
+  }
+  if(n > 0)
+    breadahead(ip->dev, addrs, n);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -506,6 +1066,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
+    if(off/BSIZE != ip->ralast)
+      readahead(ip, off/BSIZE);
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -533,7 +1095,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > ((ip->flags & I_EXTENT) ? MAXFILEX : MAXFILE)*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
@@ -569,31 +1131,150 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// The name cache remembers what dirlookup() found: the inode
+// number and offset of the entry for a name in a directory,
+// or that there is none (inum 0). It is a direct-mapped table
+// of NDCACHE entries. Entries change only with the directory
+// locked: dirlookup() and dirlink() fill them in, unlinking
+// a name calls dcput() to record its absence, and freeing a
+// directory purges its entries, since its inum may be reused.
+
+struct dcent {
+  uint dev;
+  uint dinum;        // directory; 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;         // 0 if the directory has no such name
+  uint off;
+};
+
+struct {
+  struct spinlock lock;
+  struct dcent ent[NDCACHE];
+} dcache;
+
+void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dcent*
+dchash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.ent[h % NDCACHE];
+}
+
+// Look up name in directory dp in the name cache.
+// Returns 1 and sets *inum and *off if it is there.
+static int
+dclookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dcent *d;
+  int found = 0;
+
+  acquire(&dcache.lock);
+  d = dchash(dp->dev, dp->inum, name);
+  if(d->dinum == dp->inum && d->dev == dp->dev &&
+     namecmp(d->name, name) == 0){
+    *inum = d->inum;
+    *off = d->off;
+    found = 1;
+  }
+  release(&dcache.lock);
+  return found;
+}
+
+// Record in the name cache that directory dp has an entry
+// for name at offset off naming inode inum, or has no entry
+// for name if inum is 0.
+// Caller must hold dp->lock.
+void
+dcput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dcent *d;
+
+  acquire(&dcache.lock);
+  d = dchash(dp->dev, dp->inum, name);
+  d->dev = dp->dev;
+  d->dinum = dp->inum;
+  strncpy(d->name, name, DIRSIZ);
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Forget all names cached for directory dinum on device dev.
+static void
+dcpurge(uint dev, uint dinum)
+{
+  struct dcent *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < dcache.ent+NDCACHE; d++){
+    if(d->dinum == dinum && d->dev == dev)
+      d->dinum = 0;
+  }
+  release(&dcache.lock);
+}
+
+// Read the block of directory dp holding byte offset off.
+static struct buf*
+dirblock(struct inode *dp, uint off)
+{
+  uint addr;
+
+  if((addr = bmap(dp, off/BSIZE)) == 0)
+    panic("dirblock");
+  return bread(dp->dev, addr);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint boff, off, inum;
+  struct buf *bp;
+  struct dirent *de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if(dclookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  // scan the entries of each block in place.
+  for(boff = 0; boff < dp->size; boff += BSIZE){
+    bp = dirblock(dp, boff);
+    de = (struct dirent*)bp->data;
+    for(off = boff; off < boff + BSIZE && off < dp->size; off += sizeof(*de), de++){
+      if(de->inum == 0)
+        continue;
+      if(namecmp(name, de->name) == 0){
+        // entry matches path element
+        if(poff)
+          *poff = off;
+        inum = de->inum;
+        brelse(bp);
+        dcput(dp, name, inum, off);
+        return iget(dp->dev, inum);
+      }
     }
+    brelse(bp);
   }
 
+  dcput(dp, name, 0, 0);
   return 0;
 }
 
@@ -602,8 +1283,9 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
-  struct dirent de;
+  uint boff, off;
+  struct dirent de, *d;
+  struct buf *bp;
   struct inode *ip;
 
   // Check that name is not present.
@@ -612,18 +1294,30 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  // Look for an empty dirent, and fill it in place.
+  for(boff = 0; boff < dp->size; boff += BSIZE){
+    bp = dirblock(dp, boff);
+    d = (struct dirent*)bp->data;
+    for(off = boff; off < boff + BSIZE && off < dp->size; off += sizeof(*d), d++){
+      if(d->inum == 0){
+        strncpy(d->name, name, DIRSIZ);
+        d->inum = inum;
+        log_write(bp);
+        brelse(bp);
+        dcput(dp, name, inum, off);
+        return 0;
+      }
+    }
+    brelse(bp);
   }
 
+  // None; append one.
+  off = dp->size;
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcput(dp, name, inum, off);
 
   return 0;
 }
@@ -24,9 +24,25 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
+
+// An extent inode, whose type has the I_EXTENT flag set,
+// maps its blocks with runs of consecutive disk blocks
+// instead: addrs[] holds the first NEXTENT extents and
+// addrs[XINDIRECT] the block holding the next NXEXTENT.
+#define I_EXTENT 0x100
+#define NEXTENT ((NDIRECT + 2) / 2)
+#define XINDIRECT (NDIRECT + 2)
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+#define MAXFILEX (0x80000000U / BSIZE)
+
+struct extent {
+  uint start;  // first disk block
+  uint len;    // number of blocks; 0 ends the list
+};
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +51,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+3];   // Data block addresses
 };
 
 // Inodes per block.
@@ -50,6 +66,17 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Log blocks an FS system call reserves with begin_op(), not
+// counting free map blocks, which the log reserves once for
+// each transaction (see log.c).
+// Freeing an inode writes the inode.
+#define OPPUT       1  // may drop an inode reference
+#define OPCREATE    (MAXOPBLOCKS + OPPUT)  // creates, links or unlinks a name
+// Writing n bytes writes one more data block than n covers
+// if unaligned, the inode, and up to three indirect blocks:
+// the double-indirect block and two indirect blocks.
+#define OPWRITE(n)  (((n)+BSIZE-1)/BSIZE + 1 + 4)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
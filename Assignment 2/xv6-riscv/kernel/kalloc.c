@@ -14,19 +14,51 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// Pages move between a CPU's free list and the global
+// pool KBATCH at a time; a CPU list holding more than
+// KCPUMAX pages drains a batch back to the pool.
+#define KBATCH  32
+#define KCPUMAX (2*KBATCH)
+
+// Most pages kept zeroed ahead of time for kalloc_zeroed().
+#define KZEROMAX 64
+
+// Number of references to each physical page, from page
+// tables sharing it copy-on-write after fork. Updated with
+// atomic instructions; a page is freed when it drops to 0.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+static int refcnt[(PHYSTOP - KERNBASE) / PGSIZE];
+
 struct run {
   struct run *next;
 };
 
-struct {
+struct kmemlist {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+// Each CPU allocates from and frees to its own list, so
+// harts don't serialize on one lock. A CPU whose list runs
+// dry refills a batch from the global pool, or failing
+// that steals half of a neighbour's list.
+// Idle CPUs fill the zeroed list; see kzero_idle().
+struct {
+  struct kmemlist pool;
+  struct kmemlist cpu[NCPU];
+  struct kmemlist zeroed;
 } kmem;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  struct kmemlist *l;
+
+  initlock(&kmem.pool.lock, "kmem");
+  initlock(&kmem.zeroed.lock, "kmem");
+  for(l = kmem.cpu; l < &kmem.cpu[NCPU]; l++)
+    initlock(&l->lock, "kmem");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +67,158 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    refcnt[PA2REF(p)] = 1;
     kfree(p);
+  }
+}
+
+// Detach up to n pages from l and return them as a
+// chain; *got is set to the number of pages taken.
+// Caller must hold l->lock.
+static struct run*
+takepages(struct kmemlist *l, int n, int *got)
+{
+  struct run *first, *r;
+  int i;
+
+  first = l->freelist;
+  if(first == 0 || n <= 0){
+    *got = 0;
+    return 0;
+  }
+  r = first;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  l->freelist = r->next;
+  r->next = 0;
+  l->nfree -= i;
+  *got = i;
+  return first;
+}
+
+// Prepend a chain of n pages to l.
+// Caller must hold l->lock.
+static void
+putpages(struct kmemlist *l, struct run *first, int n)
+{
+  struct run *r;
+
+  if(first == 0)
+    return;
+  for(r = first; r->next; r = r->next)
+    ;
+  r->next = l->freelist;
+  l->freelist = first;
+  l->nfree += n;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Refill the free list of CPU id, which is empty, from
+// the global pool or from another CPU. Returns one page
+// for the caller, or 0 if memory is exhausted.
+static struct run*
+refill(int id)
+{
+  struct kmemlist *l;
+  struct run *r;
+  int i, n;
+
+  acquire(&kmem.pool.lock);
+  r = takepages(&kmem.pool, KBATCH, &n);
+  release(&kmem.pool.lock);
+
+  for(i = 1; r == 0 && i < NCPU; i++){
+    l = &kmem.cpu[(id + i) % NCPU];
+    acquire(&l->lock);
+    r = takepages(l, (l->nfree + 1) / 2, &n);
+    release(&l->lock);
+  }
+  if(r == 0){
+    // last resort: a page zeroed ahead of time.
+    acquire(&kmem.zeroed.lock);
+    r = takepages(&kmem.zeroed, 1, &n);
+    release(&kmem.zeroed.lock);
+  }
+  if(r == 0)
+    return 0;
+
+  l = &kmem.cpu[id];
+  acquire(&l->lock);
+  putpages(l, r->next, n - 1);
+  release(&l->lock);
+  return r;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, and free it if that was the last one. pa
+// normally should have been returned by a call to kalloc().
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(void *pa)
 {
+  struct kmemlist *l;
   struct run *r;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&refcnt[PA2REF(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: refcnt");
+
+#ifdef JUNKFILL
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  l = &kmem.cpu[cpuid()];
+  acquire(&l->lock);
+  r->next = l->freelist;
+  l->freelist = r;
+  l->nfree++;
+  if(l->nfree > KCPUMAX)
+    r = takepages(l, KBATCH, &n);
+  else
+    r = 0;
+  release(&l->lock);
+  pop_off();
+
+  if(r){
+    acquire(&kmem.pool.lock);
+    putpages(&kmem.pool, r, n);
+    release(&kmem.pool.lock);
+  }
+}
+
+// Take a page from this CPU's free list, refilling it
+// if it is empty. Returns 0 if no page is free.
+static struct run*
+allocpage(void)
+{
+  struct kmemlist *l;
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  l = &kmem.cpu[id];
+  acquire(&l->lock);
+  r = l->freelist;
+  if(r){
+    l->freelist = r->next;
+    l->nfree--;
+  }
+  release(&l->lock);
+  if(r == 0)
+    r = refill(id);
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +229,90 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  // out of pages: have the buffer cache give some back.
+  if((r = allocpage()) == 0 && bshrink() > 0)
+    r = allocpage();
 
+  if(r)
+    refcnt[PA2REF(r)] = 1;
+#ifdef JUNKFILL
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Allocate one zero-filled page of physical memory,
+// preferably one zeroed ahead of time by an idle CPU.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  int n;
+
+  acquire(&kmem.zeroed.lock);
+  r = takepages(&kmem.zeroed, 1, &n);
+  release(&kmem.zeroed.lock);
+
+  if(r){
+    r->next = 0;  // the only non-zero word
+    refcnt[PA2REF(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Called by scheduler() on a CPU with nothing to run:
+// zero one free page for kalloc_zeroed().
+// Returns 1 if it did, 0 if there was nothing to do.
+int
+kzero_idle(void)
+{
+  struct run *r;
+
+  if(kmem.zeroed.nfree >= KZEROMAX)
+    return 0;
+  if((r = allocpage()) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kmem.zeroed.lock);
+  r->next = 0;
+  putpages(&kmem.zeroed, r, 1);
+  release(&kmem.zeroed.lock);
+  return 1;
+}
+
+// Add a reference to the allocated page at pa, which
+// another page table is about to share.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  __sync_fetch_and_add(&refcnt[PA2REF(pa)], 1);
+}
+
+// Return the number of references to the page at pa.
+int
+krefcount(void *pa)
+{
+  return refcnt[PA2REF(pa)];
+}
+
+// Return the number of free pages.
+// Reads the counts without locks; it is only an estimate.
+int
+kfreepages(void)
+{
+  struct kmemlist *l;
+  int n;
+
+  n = kmem.pool.nfree + kmem.zeroed.nfree;
+  for(l = kmem.cpu; l < &kmem.cpu[NCPU]; l++)
+    n += l->nfree;
+  return n;
+}
@@ -16,10 +16,35 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves log space for as
+// many blocks as the call may write (see OPPUT etc. in fs.h)
+// and returns, unless the reservations of the FS system calls
+// in the transaction would overflow the log; then it sleeps
+// until the last outstanding end_op() commits.
+// A call that frees a large file may change every free map
+// block, but the log writes each block once per transaction
+// however many calls change it, so each transaction reserves
+// the whole free map once instead of each call doing so.
+//
+// The log is sb.nlog blocks long, the header included,
+// but holds at most LOGMAX blocks.
+//
+// Commits overlap with the next transaction: once the last
+// outstanding end_op() has copied ("frozen") the committing
+// transaction's blocks, new FS system calls may start and
+// accumulate a new transaction in memory while the frozen
+// copies are written to the log. The frozen copies keep later
+// updates to the same blocks out of the committing transaction.
+// Commits themselves are serialized; whichever process is
+// committing also commits a transaction that completes while
+// it is busy (group commit).
+//
+// Committed blocks are not installed at their home locations
+// right away. Each commit appends its blocks to the log, and
+// the blocks stay pinned in the cache, with a frozen copy of
+// their latest committed contents, until the log fills up.
+// Then checkpoint() writes each block home once, however many
+// transactions changed it, and empties the log.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,22 +53,44 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A block may appear more than once; the last copy wins.
+// A commit hands all its blocks to the disk at once; since
+// they are consecutive in the log, the disk driver can write
+// them with a single request.
+
+// blocks written to disk at once by recover_trans().
+#define NBATCH 8
+
+// most blocks a header block can describe.
+#define LOGMAX ((BSIZE / sizeof(int)) - 2)
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGBLOCKS];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
+  int size;        // blocks the log holds, not counting the header.
+  int reserved;    // blocks reserved by the FS sys calls in lh,
+                   // and the free map.
+  int nbmap;       // free map blocks.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // a process is in commit().
+  int freezing;    // commit() is copying blocks, please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // transaction FS sys calls add to.
+  struct logheader clh;  // transaction being committed.
+  struct logheader dh;   // the on-disk header: committed blocks.
+  // frozen copies of the latest committed contents of the
+  // ncopy distinct blocks in dh, and their block numbers.
+  struct buf *frozen[LOGMAX];
+  int home[LOGMAX];
+  int ncopy;
+  struct buf *batch[LOGMAX]; // for bwritev(), which sorts it.
 };
 struct log log;
 
@@ -53,33 +100,63 @@ static void commit();
 void
 initlog(int dev, struct superblock *sb)
 {
+  int i, per = PGSIZE / sizeof(struct buf);
+  char *page = 0, *data = 0;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
+  log.size = sb->nlog - 1;
+  if (log.size > LOGMAX)
+    log.size = LOGMAX;
+  log.nbmap = sb->size / BPB + 1;
+  log.reserved = log.nbmap;
+  if (log_size() < OPCREATE || log_size() < 2*OPWRITE(BSIZE))
+    panic("initlog: log too small");
   log.dev = dev;
+  for (i = 0; i < log.size; i++) {
+    if (i % per == 0 && (page = kalloc()) == 0)
+      panic("initlog: kalloc");
+    if (i % (PGSIZE/BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.frozen[i] = (struct buf *)page + i % per;
+    log.frozen[i]->data = (uchar *)data + i % (PGSIZE/BSIZE) * BSIZE;
+    log.frozen[i]->dev = dev;
+    log.frozen[i]->disk = 0;
+    initsleeplock(&log.frozen[i]->lock, "frozen");
+  }
   recover_from_log();
 }
 
 // Copy committed blocks from log to their home location
+// when recovering from a crash, NBATCH blocks at a time.
+// Only the last copy of each block is installed.
 static void
-install_trans(int recovering)
+recover_trans(void)
 {
-  int tail;
+  int tail, i, j, n;
+  struct buf *dbufs[NBATCH];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    if(recovering) {
-      printf("recovering tail %d dst %d\n", tail, log.lh.block[tail]);
+  for (tail = 0; tail < log.dh.n; tail += i) {
+    n = 0;
+    for (i = 0; tail+i < log.dh.n && n < NBATCH; i++) {
+      for (j = tail+i+1; j < log.dh.n; j++)
+        if (log.dh.block[j] == log.dh.block[tail+i])
+          break;
+      if (j < log.dh.n)
+        continue;   // superseded by a later copy
+      printf("recovering tail %d dst %d\n", tail+i, log.dh.block[tail+i]);
+      struct buf *lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+      dbufs[n] = bread(log.dev, log.dh.block[tail+i]); // read dst
+      memmove(dbufs[n]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      n++;
     }
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+    bwritev(dbufs, n);  // write dsts to disk
+    for (j = 0; j < n; j++)
+      brelse(dbufs[j]);
   }
 }
 
@@ -90,25 +167,24 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.dh.n = lh->n;
+  for (i = 0; i < log.dh.n; i++) {
+    log.dh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the in-memory copy of the on-disk header to disk.
+// This is the true point at which a transaction commits.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.dh.n;
+  for (i = 0; i < log.dh.n; i++) {
+    hb->block[i] = log.dh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -118,23 +194,29 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  recover_trans(); // if committed, copy from log to disk
+  log.dh.n = 0;
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that
+// writes at most nblocks distinct blocks.
+// The reservation lasts until the transaction commits.
 void
-begin_op(void)
+begin_op(int nblocks)
 {
+  if(nblocks > log_size())
+    panic("begin_op: too many blocks");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.freezing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGBLOCKS){
+    } else if(log.reserved + nblocks > log.size){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
+      log.reserved += nblocks;
       log.outstanding += 1;
       release(&log.lock);
       break;
@@ -142,8 +224,18 @@ begin_op(void)
   }
 }
 
+// Blocks the log holds besides the free map; an FS system
+// call can't write more.
+int
+log_size(void)
+{
+  return log.size - log.nbmap;
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless a commit is already under way; then that
+// commit()'s caller commits this transaction next.
 void
 end_op(void)
 {
@@ -151,15 +243,14 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.freezing)
+    panic("log.freezing");
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_op() may be waiting for the commit
+    // that starts a new transaction.
     wakeup(&log);
   }
   release(&log.lock);
@@ -168,44 +259,134 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Return the frozen copy of block blockno, or -1.
+static int
+copyof(int blockno)
+{
+  int i;
+
+  for (i = 0; i < log.ncopy; i++)
+    if (log.home[i] == blockno)
+      return i;
+  return -1;
+}
+
+// Copy the committing transaction's blocks from the cache
+// to their frozen copies. No FS system calls are running.
 static void
-write_log(void)
+freeze_trans(void)
 {
-  int tail;
+  int i, j;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (i = 0; i < log.clh.n; i++) {
+    struct buf *from = bread(log.dev, log.clh.block[i]); // cache block
+    if ((j = copyof(log.clh.block[i])) < 0) {
+      j = log.ncopy++;
+      log.home[j] = log.clh.block[i];
+    } else {
+      bunpin(from);  // already pinned by an earlier transaction
+    }
+    memmove(log.frozen[j]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
 }
 
+// Append the committing transaction's frozen blocks to the log.
+static void
+write_log(void)
+{
+  int i;
+  struct buf *fb;
+
+  for (i = 0; i < log.clh.n; i++) {
+    fb = log.frozen[copyof(log.clh.block[i])];
+    acquiresleep(&fb->lock);
+    fb->blockno = log.start+log.dh.n+i+1;
+    log.batch[i] = fb;
+  }
+  bwritev(log.batch, log.clh.n);
+  for (i = 0; i < log.clh.n; i++) {
+    releasesleep(&log.batch[i]->lock);
+    log.dh.block[log.dh.n+i] = log.clh.block[i];
+  }
+  log.dh.n += log.clh.n;
+}
+
+// Install the latest committed contents of every block in
+// the log at its home location, let the cache evict the
+// blocks again, and empty the log.
+static void
+checkpoint(void)
+{
+  int i;
+
+  for (i = 0; i < log.ncopy; i++) {
+    acquiresleep(&log.frozen[i]->lock);
+    log.frozen[i]->blockno = log.home[i];
+    log.batch[i] = log.frozen[i];
+  }
+  bwritev(log.batch, log.ncopy);  // in block order
+  for (i = 0; i < log.ncopy; i++)
+    releasesleep(&log.frozen[i]->lock);
+  for (i = 0; i < log.ncopy; i++) {
+    struct buf *b = bread(log.dev, log.home[i]);
+    bunpin(b);
+    brelse(b);
+  }
+  log.ncopy = 0;
+  log.dh.n = 0;
+  write_head();    // Erase the transactions from the log
+}
+
+// Commit the current transaction, and then any that
+// complete while doing so. Caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  acquire(&log.lock);
+  while (log.outstanding == 0 && log.lh.n > 0) {
+    if (log.dh.n + log.lh.n > log.size) {
+      // no room in the log; FS sys calls may go on
+      // while it is emptied.
+      release(&log.lock);
+      checkpoint();
+      acquire(&log.lock);
+      continue;
+    }
+
+    // take the transaction, and hold off new FS sys
+    // calls until its blocks are frozen.
+    log.clh = log.lh;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.reserved = log.nbmap;
+    log.freezing = 1;
+    release(&log.lock);
+
+    freeze_trans();
+
+    acquire(&log.lock);
+    log.freezing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log();     // Write frozen blocks to log
+    write_head();    // Write header to disk -- the real commit
+
+    acquire(&log.lock);
   }
+  if (log.outstanding == 0 && log.lh.n == 0)
+    log.reserved = log.nbmap;  // nothing to commit; start afresh
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -218,7 +399,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGBLOCKS)
+  if (log.lh.n >= log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
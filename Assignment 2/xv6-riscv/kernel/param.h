@@ -2,14 +2,18 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum size of in-memory i-node cache
+#define ICACHEFRAC   64  // i-node cache may use 1/ICACHEFRAC of free memory
+#define NDCACHE      256 // entries in directory name cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  10  // max # of blocks an FS op writes, not counting write() or freeing an inode
+#define LOGBLOCKS    64  // data blocks in on-disk log made by mkfs
+#define NBUF         (LOGBLOCKS*3)  // minimum size of disk block cache
+#define BCACHEFRAC   8     // disk block cache may use 1/BCACHEFRAC of free memory
+#define FSSIZE       100000  // size of file system in blocks
+#define NREADAHEAD   8     // blocks read ahead of a sequential reader
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
 
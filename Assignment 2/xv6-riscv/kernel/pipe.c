@@ -8,17 +8,61 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// A pipe's buffer is a ring of size bytes, a power of two,
+// in pages from kalloc(). Readers and writers copy the
+// longest run that neither wraps around the ring nor
+// crosses a page with one copyin() or copyout().
+#define PIPESIZE    PGSIZE       // initial buffer size
+#define MAXPIPESIZE (16*PGSIZE)  // largest pipesize() allows
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *buf[MAXPIPESIZE/PGSIZE]; // pages of the buffer
+  uint size;      // bytes in the buffer
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rsplice;    // a splice is copying from the read end
+  int wsplice;    // a splice is copying to the write end
 };
 
+// Return the address of byte i of pi's stream in the buffer,
+// and in *run the bytes from there to the end of the ring or
+// of the page, whichever comes first.
+static char*
+pipebuf(struct pipe *pi, uint i, uint *run)
+{
+  uint off = i % pi->size;
+
+  *run = pi->size - off;
+  if(*run > PGSIZE - off % PGSIZE)
+    *run = PGSIZE - off % PGSIZE;
+  return pi->buf[off / PGSIZE] + off % PGSIZE;
+}
+
+// Free the pages of a buffer of size bytes.
+static void
+freebuf(char **buf, uint size)
+{
+  for(int i = 0; i < (size + PGSIZE - 1) / PGSIZE; i++)
+    kfree(buf[i]);
+}
+
+// Allocate the pages for a buffer of size bytes.
+// Returns 0 if out of memory.
+static int
+allocbuf(char **buf, uint size)
+{
+  for(int i = 0; i < (size + PGSIZE - 1) / PGSIZE; i++){
+    if((buf[i] = kalloc()) == 0){
+      freebuf(buf, i * PGSIZE);
+      return 0;
+    }
+  }
+  return 1;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -30,10 +74,18 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  if(allocbuf(pi->buf, PIPESIZE) == 0){
+    kfree((char*)pi);
+    pi = 0;
+    goto bad;
+  }
+  pi->size = PIPESIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->rsplice = 0;
+  pi->wsplice = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -55,6 +107,48 @@ pipealloc(struct file **f0, struct file **f1)
   return -1;
 }
 
+// Give pi a buffer of size bytes, rounded up to a power of
+// two, keeping the bytes in it. Returns the new size, or -1
+// if size is out of range or too small for those bytes.
+int
+pipesize(struct pipe *pi, int size)
+{
+  char *buf[MAXPIPESIZE/PGSIZE], *src;
+  uint n, m, run, i;
+
+  if(size < 1 || size > MAXPIPESIZE)
+    return -1;
+  for(n = 1; n < size; n *= 2)
+    ;
+  if(allocbuf(buf, n) == 0)
+    return -1;
+
+  acquire(&pi->lock);
+  if(pi->nwrite - pi->nread > n || pi->rsplice || pi->wsplice){
+    release(&pi->lock);
+    freebuf(buf, n);
+    return -1;
+  }
+  // copy the unread bytes to the start of the new buffer.
+  for(i = 0; pi->nread + i != pi->nwrite; i += m){
+    src = pipebuf(pi, pi->nread + i, &run);
+    m = pi->nwrite - (pi->nread + i);
+    if(m > run)
+      m = run;
+    if(m > PGSIZE - i % PGSIZE)
+      m = PGSIZE - i % PGSIZE;
+    memmove(buf[i / PGSIZE] + i % PGSIZE, src, m);
+  }
+  freebuf(pi->buf, pi->size);
+  memmove(pi->buf, buf, sizeof(buf));
+  pi->size = n;
+  pi->nread = 0;
+  pi->nwrite = i;
+  wakeup(&pi->nwrite);
+  release(&pi->lock);
+  return n;
+}
+
 void
 pipeclose(struct pipe *pi, int writable)
 {
@@ -68,6 +162,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
+    freebuf(pi->buf, pi->size);
     kfree((char*)pi);
   } else
     release(&pi->lock);
@@ -77,6 +172,8 @@ int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
+  uint m, run;
+  char *dst;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,15 +182,20 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+    if(pi->nwrite == pi->nread + pi->size || pi->wsplice){ //DOC: pipewrite-full
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      dst = pipebuf(pi, pi->nwrite, &run);
+      m = pi->nread + pi->size - pi->nwrite;
+      if(m > run)
+        m = run;
+      if(m > n - i)
+        m = n - i;
+      if(copyin(pr->pagetable, dst, addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -106,29 +208,124 @@ int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint m, run;
+  char *src;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rsplice){  //DOC: pipe-empty
     if(killed(pr)){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1) {
+    src = pipebuf(pi, pi->nread, &run);
+    m = pi->nwrite - pi->nread;
+    if(m > run)
+      m = run;
+    if(m > n - i)
+      m = n - i;
+    if(copyout(pr->pagetable, addr + i, src, m) == -1) {
       if(i == 0)
         i = -1;
       break;
     }
-    pi->nread++;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// filesplice() copies between a file and pi's buffer without
+// holding pi->lock, by reserving one end of the pipe. Other
+// writers wait while the write end is reserved, and other
+// readers while the read end is.
+
+// Wait for free space in pi and reserve the write end.
+// Returns the bytes free in *dst, up to the end of the
+// run, or -1 if the read end is closed.
+int
+pipewbegin(struct pipe *pi, char **dst)
+{
+  uint m, run;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  for(;;){
+    if(pi->readopen == 0 || killed(pr)){
+      release(&pi->lock);
+      return -1;
+    }
+    if(pi->nwrite != pi->nread + pi->size && !pi->wsplice)
+      break;
+    wakeup(&pi->nread);
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  *dst = pipebuf(pi, pi->nwrite, &run);
+  m = pi->nread + pi->size - pi->nwrite;
+  if(m > run)
+    m = run;
+  pi->wsplice = 1;
+  release(&pi->lock);
+  return m;
+}
+
+// Add the n bytes copied to the write end and release it.
+void
+pipewend(struct pipe *pi, int n)
+{
+  acquire(&pi->lock);
+  pi->nwrite += n;
+  pi->wsplice = 0;
+  wakeup(&pi->nread);
+  wakeup(&pi->nwrite);
+  release(&pi->lock);
+}
+
+// Reserve the read end of pi, waiting for bytes if wait is
+// set. Returns the bytes available in *src, up to the end
+// of the run, 0 if there are none, or -1 if killed. Only
+// reserves the read end if it returns more than 0.
+int
+piperbegin(struct pipe *pi, char **src, int wait)
+{
+  uint m, run;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while((pi->nread == pi->nwrite && pi->writeopen && wait) || pi->rsplice){
+    if(killed(pr)){
+      release(&pi->lock);
+      return -1;
+    }
+    sleep(&pi->nread, &pi->lock);
+  }
+  if(pi->nread == pi->nwrite){
+    release(&pi->lock);
+    return 0;
+  }
+  *src = pipebuf(pi, pi->nread, &run);
+  m = pi->nwrite - pi->nread;
+  if(m > run)
+    m = run;
+  pi->rsplice = 1;
+  release(&pi->lock);
+  return m;
+}
+
+// Consume the n bytes copied from the read end and release it.
+void
+piperend(struct pipe *pi, int n)
+{
+  acquire(&pi->lock);
+  pi->nread += n;
+  pi->rsplice = 0;
+  wakeup(&pi->nwrite);
+  wakeup(&pi->nread);
+  release(&pi->lock);
+}
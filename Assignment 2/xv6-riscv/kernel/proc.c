@@ -4,14 +4,26 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sched.h"
+#include "fs.h"
 #include "defs.h"
 
+#ifndef SCHEDMODE
+#define SCHEDMODE SCHED_LOTTERY
+#endif
+
+// Stride of a process holding a single ticket.
+#define STRIDE1 (1 << 20)
+
 struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
 struct proc *initproc;
 
+// Scheduling policy used by scheduler(); see setsched().
+int schedmode = SCHEDMODE;
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
@@ -48,9 +60,14 @@ void
 procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(c = cpus; c < &cpus[NCPU]; c++) {
+      initlock(&c->rq.lock, "runq");
+      c->rq.seed = (c - cpus) + 1;
+  }
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -102,6 +119,128 @@ allocpid()
   return pid;
 }
 
+// Add delta tickets to proc[] slot i in run queue rq.
+// Caller must hold rq->lock.
+static void
+rq_add(struct runq *rq, int i, int delta)
+{
+  rq->weight[i] += delta;
+  rq->total += delta;
+  for(i++; i <= NPROC; i += i & -i)
+    rq->tree[i] += delta;
+}
+
+// Return the proc[] slot that owns ticket t in rq,
+// where 0 <= t < rq->total.
+// Caller must hold rq->lock.
+static int
+rq_find(struct runq *rq, int t)
+{
+  int i, step;
+
+  for(step = 1; step*2 <= NPROC; step *= 2)
+    ;
+  // descend to the largest i whose prefix sum is <= t;
+  // slot i (0-indexed) holds the winning ticket.
+  for(i = 0; step > 0; step /= 2){
+    if(i + step <= NPROC && rq->tree[i+step] <= t){
+      i += step;
+      t -= rq->tree[i];
+    }
+  }
+  return i;
+}
+
+// Put rq->heap[i] = p and record its position.
+// Caller must hold rq->lock.
+static void
+heap_set(struct runq *rq, int i, struct proc *p)
+{
+  rq->heap[i] = p;
+  p->heapidx = i;
+}
+
+// Restore heap order around rq->heap[i].
+// Caller must hold rq->lock.
+static void
+heap_fix(struct runq *rq, int i)
+{
+  struct proc *p = rq->heap[i];
+  int child;
+
+  while(i > 0 && rq->heap[(i-1)/2]->pass > p->pass){
+    heap_set(rq, i, rq->heap[(i-1)/2]);
+    i = (i-1)/2;
+  }
+  while((child = 2*i + 1) < rq->nheap){
+    if(child + 1 < rq->nheap && rq->heap[child+1]->pass < rq->heap[child]->pass)
+      child++;
+    if(rq->heap[child]->pass >= p->pass)
+      break;
+    heap_set(rq, i, rq->heap[child]);
+    i = child;
+  }
+  heap_set(rq, i, p);
+}
+
+// Take p out of rq's heap.
+// Caller must hold rq->lock.
+static void
+heap_remove(struct runq *rq, struct proc *p)
+{
+  int i = p->heapidx;
+
+  p->heapidx = -1;
+  rq->nheap--;
+  if(i != rq->nheap){
+    heap_set(rq, i, rq->heap[rq->nheap]);
+    heap_fix(rq, i);
+  }
+}
+
+// Mark p RUNNABLE and enter it in the run queue
+// of the CPU it last ran on.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &cpus[p->cpu].rq;
+  int i = p - proc;
+
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  rq_add(rq, i, p->tickets - rq->weight[i]);
+  p->stride = STRIDE1 / p->tickets;
+  if(p->heapidx < 0){
+    // don't let a process that slept, or came from a
+    // queue that is behind, catch up by monopolizing.
+    if(p->pass < rq->vpass)
+      p->pass = rq->vpass;
+    heap_set(rq, rq->nheap++, p);
+    heap_fix(rq, p->heapidx);
+  }
+  release(&rq->lock);
+}
+
+// Withdraw p from its run queue as the scheduler
+// dispatches it.
+// Caller must hold p->lock.
+static void
+clearrunnable(struct proc *p)
+{
+  struct runq *rq = &cpus[p->cpu].rq;
+  int i = p - proc;
+
+  acquire(&rq->lock);
+  rq_add(rq, i, -rq->weight[i]);
+  heap_remove(rq, p);
+  if(p->pass > rq->vpass)
+    rq->vpass = p->pass;
+  // charge p for the time slice it is about to use.
+  p->pass += p->stride;
+  release(&rq->lock);
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -149,6 +288,9 @@ found:
   // Initialize tickets and rounds for lottery scheduling
   p->tickets = 10;  // Default tickets (init process gets 10)
   p->rounds = 0;    // Initially zero rounds
+  p->cpu = 0;
+  p->pass = 0;
+  p->heapidx = -1;
 
   return p;
 }
@@ -230,7 +372,7 @@ userinit(void)
   
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -294,8 +436,10 @@ kfork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
-  // Child inherits tickets from parent
+  // Child inherits tickets from parent, and starts out
+  // on the parent's run queue.
   np->tickets = p->tickets;
+  np->cpu = p->cpu;
 
   pid = np->pid;
 
@@ -306,7 +450,7 @@ kfork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -347,7 +491,7 @@ kexit(int status)
     }
   }
 
-  begin_op();
+  begin_op(OPPUT);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
@@ -437,18 +581,53 @@ do_rand(unsigned long *ctx)
   return (x);
 }
 
-unsigned long rand_next = 1;
+// Choose a process from rq by the current scheduling
+// policy and return its proc[] slot, or -1 if no process
+// is queued on rq.
+static int
+rq_draw(struct runq *rq)
+{
+  int slot = -1;
+
+  acquire(&rq->lock);
+  if(schedmode == SCHED_STRIDE) {
+    if(rq->nheap > 0)
+      slot = rq->heap[0] - proc;
+  } else if(rq->total > 0) {
+    int winning_ticket = do_rand(&rq->seed) % rq->total;
+    if(winning_ticket < 0)
+      winning_ticket += rq->total;
+    slot = rq_find(rq, winning_ticket);
+  }
+  release(&rq->lock);
+  return slot;
+}
 
-int
-rand(void)
+// Return the run queue of another CPU holding the most
+// tickets, or 0 if every other queue is empty.
+// Reads the totals without locks; it is only a hint.
+static struct runq*
+busiest(struct cpu *self)
 {
-  return (do_rand(&rand_next));
+  struct cpu *c;
+  struct runq *rq = 0;
+  int most = 0;
+
+  for(c = cpus; c < &cpus[NCPU]; c++) {
+    if(c != self && c->rq.total > most) {
+      most = c->rq.total;
+      rq = &c->rq;
+    }
+  }
+  return rq;
 }
 
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run using lottery scheduling.
+//  - choose a process to run from this CPU's run queue, by
+//    lottery or by lowest stride pass (see setsched()), or
+//    steal one from the busiest other queue if this one is empty.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -468,54 +647,44 @@ scheduler(void)
     intr_on();
     intr_off();
 
-    // Lottery scheduling implementation
-    int found = 0;
-    
-    // First, calculate total tickets of all RUNNABLE processes
-    int total_tickets = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    // Draw a winner from the local run queue, or from
+    // the busiest other one if the local queue is empty.
+    int slot = rq_draw(&c->rq);
+    if(slot < 0) {
+      struct runq *rq = busiest(c);
+      if(rq)
+        slot = rq_draw(rq);
+    }
+
+    if(slot >= 0) {
+      p = &proc[slot];
       acquire(&p->lock);
+      // another CPU may have picked p since the draw;
+      // if so, just draw again.
       if(p->state == RUNNABLE) {
-        total_tickets += p->tickets;
+        // Switch to chosen process.  It is the process's job
+        // to release its lock and then reacquire it
+        // before jumping back to us.
+        clearrunnable(p);
+        p->cpu = c - cpus;  // a stolen process migrates here
+        p->state = RUNNING;
+        p->rounds++;  // Increment rounds counter
+        c->proc = p;
+        swtch(&c->context, &p->context);
+
+        // Process is done running for now.
+        // It should have changed its p->state before coming back.
+        c->proc = 0;
       }
       release(&p->lock);
     }
 
-    // If there are runnable processes, pick one using lottery scheduling
-    if(total_tickets > 0) {
-      // Generate a random winning ticket in range [0, total_tickets - 1]
-      int winning_ticket = rand() % total_tickets;
-      if (winning_ticket < 0)
-      winning_ticket += total_tickets;
-      int ticket_count = 0;
-      
-      // Find the process that owns the winning ticket
-      for(p = proc; p < &proc[NPROC]; p++) {
-        acquire(&p->lock);
-        if(p->state == RUNNABLE) {
-          ticket_count += p->tickets;
-          if(ticket_count > winning_ticket) {
-            // This process wins the lottery
-            p->state = RUNNING;
-            p->rounds++;  // Increment rounds counter
-            c->proc = p;
-            swtch(&c->context, &p->context);
-
-            // Process is done running for now.
-            // It should have changed its p->state before coming back.
-            c->proc = 0;
-            found = 1;
-            release(&p->lock);
-            break;
-          }
-        }
-        release(&p->lock);
-      }
-    }
-    
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      asm volatile("wfi");
+    if(slot < 0) {
+      // nothing to run; zero a page for kalloc_zeroed(), or
+      // if there is no need, stop running on this core until
+      // an interrupt.
+      if(kzero_idle() == 0)
+        asm volatile("wfi");
     }
   }
 }
@@ -553,7 +722,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -637,13 +806,36 @@ wakeup(void *chan)
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
     }
   }
 }
 
+// Give p n lottery tickets. If p is waiting to run,
+// re-enter it in the lottery with the new count.
+void
+setproctickets(struct proc *p, int n)
+{
+  acquire(&p->lock);
+  p->tickets = n;
+  if(p->state == RUNNABLE)
+    setrunnable(p);
+  release(&p->lock);
+}
+
+// Switch every CPU to scheduling policy mode.
+// Ticket counts keep their meaning under either policy.
+int
+setsched(int mode)
+{
+  if(mode != SCHED_LOTTERY && mode != SCHED_STRIDE)
+    return -1;
+  schedmode = mode;
+  return 0;
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -658,7 +850,7 @@ kkill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
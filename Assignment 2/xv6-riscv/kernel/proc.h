@@ -18,12 +18,29 @@ struct context {
   uint64 s11;
 };
 
+// Per-CPU run queue: the RUNNABLE processes queued on a CPU.
+// For lottery scheduling their tickets are kept in a Fenwick
+// tree over proc[] slots so a draw costs O(log NPROC); for
+// stride scheduling they are kept in a min-heap by pass.
+// lock ordering: p->lock, then rq->lock.
+struct runq {
+  struct spinlock lock;
+  unsigned long seed;         // lottery random number state
+  int total;                  // tickets held by queued processes
+  int weight[NPROC];          // tickets entered for each proc[] slot
+  int tree[NPROC+1];          // Fenwick tree over weight[], 1-indexed
+  struct proc *heap[NPROC];   // queued processes, min-heap by pass
+  int nheap;                  // number of processes in heap[]
+  uint64 vpass;               // largest pass dispatched from this queue
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct runq rq;             // RUNNABLE processes queued on this cpu.
 };
 
 extern struct cpu cpus[NCPU];
@@ -91,6 +108,7 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Run queue p is queued on, or last ran from
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -106,4 +124,10 @@ struct proc {
   char name[16];               // Process name (debugging)
   int tickets;                 // Number of tickets for lottery scheduling
   int rounds;                  // Number of times scheduled
+
+  // p->lock, and the lock of the run queue p is on, must be
+  // held when using these:
+  uint64 stride;               // STRIDE1 / tickets
+  uint64 pass;                 // Stride scheduling virtual time
+  int heapidx;                 // Index in run queue heap[], or -1
 };
@@ -0,0 +1,3 @@
+// scheduling policies for setsched()
+#define SCHED_LOTTERY 0  // proportional share in expectation
+#define SCHED_STRIDE  1  // deterministic proportional share
@@ -1,13 +1,30 @@
 #include "types.h"
 
+// These work a 64-bit word at a time where the alignment of
+// their arguments allows, and a byte at a time otherwise.
+// An aligned word never crosses a page, so the string
+// functions may read past the NUL within one.
+typedef uint64 __attribute__((may_alias)) word;
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Non-zero if word w has a zero byte.
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
-  }
+  word w;
+
+  for(; n > 0 && (uint64)cdst % 8; n--)
+    *cdst++ = c;
+  w = (uchar)c * ONES;
+  for(; n >= 8; n -= 8, cdst += 8)
+    *(word*)cdst = w;
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +35,14 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if((uint64)s1 % 8 == (uint64)s2 % 8){
+    for(; n > 0 && (uint64)s1 % 8; n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip equal words; the loop below finds the byte that differs.
+    for(; n >= 8 && *(word*)s1 == *(word*)s2; n -= 8)
+      s1 += 8, s2 += 8;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,20 +57,37 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  int aligned;
 
   if(n == 0)
     return dst;
   
   s = src;
   d = dst;
+  aligned = (uint64)s % 8 == (uint64)d % 8;
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(aligned){
+      for(; n > 0 && (uint64)d % 8; n--)
+        *--d = *--s;
+      for(; n >= 8; n -= 8){
+        d -= 8, s -= 8;
+        *(word*)d = *(word*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(aligned){
+      for(; n > 0 && (uint64)d % 8; n--)
+        *d++ = *s++;
+      for(; n >= 8; n -= 8, d += 8, s += 8)
+        *(word*)d = *(word*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -98,10 +140,31 @@ safestrcpy(char *s, const char *t, int n)
 int
 strlen(const char *s)
 {
-  int n;
-
-  for(n = 0; s[n]; n++)
-    ;
-  return n;
+  const char *p;
+
+  for(p = s; (uint64)p % 8; p++)
+    if(*p == 0)
+      return p - s;
+  while(!HASZERO(*(word*)p))
+    p += 8;
+  while(*p)
+    p++;
+  return p - s;
 }
 
+// Return the length of s, but at most n.
+int
+strnlen(const char *s, uint n)
+{
+  const char *p, *e;
+
+  e = s + n;
+  for(p = s; p < e && (uint64)p % 8; p++)
+    if(*p == 0)
+      return p - s;
+  while(e - p >= 8 && !HASZERO(*(word*)p))
+    p += 8;
+  while(p < e && *p)
+    p++;
+  return p - s;
+}
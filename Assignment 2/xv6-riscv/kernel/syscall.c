@@ -102,6 +102,9 @@ extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_settickets(void);
+extern uint64 sys_setsched(void);
+extern uint64 sys_pipesize(void);
+extern uint64 sys_splice(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -128,6 +131,9 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_settickets] sys_settickets,
+[SYS_setsched] sys_setsched,
+[SYS_pipesize] sys_pipesize,
+[SYS_splice]  sys_splice,
 };
 
 void
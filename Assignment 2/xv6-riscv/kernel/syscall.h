@@ -21,3 +21,6 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_settickets 22
+#define SYS_setsched 23
+#define SYS_pipesize 24
+#define SYS_splice 25
@@ -129,7 +129,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(OPCREATE);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -196,7 +196,7 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(OPCREATE);
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -222,6 +222,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcput(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -314,7 +315,7 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  begin_op((omode & O_CREATE) ? OPCREATE : OPPUT);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -376,7 +377,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op(OPCREATE);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -393,7 +394,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op(OPCREATE);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -413,7 +414,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
   
-  begin_op();
+  begin_op(OPPUT);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -503,3 +504,31 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Set the buffer size of the pipe fd is an end of.
+// Returns the size, rounded up to a power of two.
+uint64
+sys_pipesize(void)
+{
+  struct file *f;
+  int size;
+
+  argint(1, &size);
+  if(argfd(0, 0, &f) < 0 || f->type != FD_PIPE)
+    return -1;
+  return pipesize(f->pipe, size);
+}
+
+// Move up to n bytes from fdin to fdout, one a file and the
+// other a pipe, without copying them through user space.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
@@ -115,6 +115,14 @@ sys_settickets(void)
   argint(0, &n);
   if(n < 1)
     return -1;
-  myproc()->tickets = n;
+  setproctickets(myproc(), n);
   return 0;
 }
+
+uint64
+sys_setsched(void)
+{
+  int mode;
+  argint(0, &mode);
+  return setsched(mode);
+}
@@ -19,6 +19,10 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// most blocks in one request, leaving descriptors
+// for other requests.
+#define MAXSEG (NUM/2 - 2)
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
@@ -41,13 +45,16 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int unnotified;  // requests in avail not yet announced to the device
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // status and async are indexed by first descriptor index
+  // of chain, b by the index of the descriptor for b->data.
   struct {
     struct buf *b;
     char status;
+    char async;  // no one waits; virtio_disk_intr() finishes up
   } info[NUM];
 
   // disk command headers.
@@ -196,12 +203,12 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer of k blocks uses k+2 descriptors.
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +219,18 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// format the n+2 descriptors of a request to read or write
+// the n bufs bs, which hold consecutive blocks, starting at
+// idx[0], and add it to the avail ring.
+// the device doesn't look at it until kick().
+// caller must hold disk.vdisk_lock.
+static void
+submit(struct buf **bs, int n, int write, int *idx, int async)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+  int i;
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,48 +247,181 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  // one descriptor per block: the device gathers (or
+  // scatters) the blocks' data.
+  for(i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) bs[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+
+    // record struct buf for virtio_disk_intr().
+    bs[i-1]->disk = 1;
+    disk.info[idx[i]].b = bs[i-1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].async = async;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
+  // another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  disk.unnotified++;
+}
+
+// tell the device about all requests submitted since the
+// last kick, with a single notification.
+// caller must hold disk.vdisk_lock.
+static void
+kick(void)
+{
+  if(disk.unnotified == 0)
+    return;
+  disk.unnotified = 0;
 
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// Start reading (write=0) or writing (write=1) b, and
+// return without waiting for the disk. Requests are only
+// queued; virtio_disk_kick() or a wait hands them to the
+// device, so a caller can batch several per notification.
+//
+// For a synchronous request the caller must hold b->lock
+// and later call virtio_disk_wait(b).
+// An asynchronous request (async=1, reads only) has no
+// waiter: when it finishes, virtio_disk_intr() marks b valid
+// and drops a reference to b with bunpin(), so the caller
+// must hold one that it hands over to the disk. It fails,
+// returning -1, if b is already busy or no descriptors
+// are free, rather than sleeping.
+int
+virtio_disk_start(struct buf *b, int write, int async)
+{
+  int idx[3];
+  struct buf *bs[1] = { b };
+
+  acquire(&disk.vdisk_lock);
+
+  // an asynchronous read of b may be in flight; a
+  // synchronous request must wait for it first.
+  if(b->disk && async){
+    release(&disk.vdisk_lock);
+    return -1;
+  }
+  while(b->disk == 1){
+    kick();
+    sleep(b, &disk.vdisk_lock);
+  }
+
+  // the spec's Section 5.2 says that legacy block operations use
+  // three descriptors: one for type/reserved/sector, one for the
+  // data, one for a 1-byte status result.
+
+  // allocate the three descriptors.
+  while(alloc_descs(idx, 3) != 0){
+    if(async){
+      release(&disk.vdisk_lock);
+      return -1;
+    }
+    // descriptors are freed as queued requests finish,
+    // so make sure the device knows about them.
+    kick();
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  }
+
+  submit(bs, 1, write, idx, async);
+
+  release(&disk.vdisk_lock);
+  return 0;
+}
+
+// Start writing the n locked bufs bs, sorted by block number,
+// as virtio_disk_start() does. Each run of consecutive blocks,
+// up to MAXSEG of them, becomes a single request, whose data
+// the device gathers from the bufs. The caller must later
+// virtio_disk_wait() for each buf.
+void
+virtio_disk_startv(struct buf **bs, int n)
+{
+  int idx[MAXSEG+2];
+  int i, k;
+
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i += k){
+    for(k = 1; i+k < n && k < MAXSEG; k++){
+      if(bs[i+k]->blockno != bs[i]->blockno + k)
+        break;
+    }
+    for(int j = i; j < i+k; j++){
+      while(bs[j]->disk == 1){
+        kick();
+        sleep(bs[j], &disk.vdisk_lock);
+      }
+    }
+    while(alloc_descs(idx, k+2) != 0){
+      kick();
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+    submit(&bs[i], k, 1, idx, 0);
+  }
+  release(&disk.vdisk_lock);
+}
+
+// Hand the requests queued by virtio_disk_start() to the device.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the disk to finish with b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+// Read or write b and wait for the disk to finish.
+// If an asynchronous read of b is in flight and b was
+// to be read, just wait for that read.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  if(!write && b->disk){
+    virtio_disk_wait(b);
+    if(b->valid)
+      return;
+  }
+  virtio_disk_start(b, write, 0);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -316,9 +447,23 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    int async = disk.info[id].async;
+    disk.info[id].async = 0;
+    for(int i = id; ; i = disk.desc[i].next){
+      struct buf *b = disk.info[i].b;
+      if(b){
+        disk.info[i].b = 0;
+        if(async)
+          b->valid = 1;
+        b->disk = 0;   // disk is done with buf
+        wakeup(b);
+        if(async)
+          bunpin(b);   // the reference handed over at start
+      }
+      if(!(disk.desc[i].flags & VRING_DESC_F_NEXT))
+        break;
+    }
+    free_chain(id);
 
     disk.used_idx += 1;
   }
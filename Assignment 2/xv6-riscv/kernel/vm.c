@@ -23,8 +23,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -105,9 +104,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -179,10 +177,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -224,12 +221,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -287,10 +283,11 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies the page table but not the physical
+// memory: writable pages become read-only and
+// copy-on-write in both, see cowcopy().
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -299,22 +296,19 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
       continue;   // page table entry hasn't been allocated
     if((*pte & PTE_V) == 0)
       continue;   // physical page hasn't been allocated
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kref((void*)pa);
   }
   return 0;
 
@@ -323,6 +317,38 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Give va its own writable copy of a copy-on-write page,
+// or just make the page writable if no other page table
+// shares it any longer.
+// Returns the page's physical address, or 0 if va is not
+// a copy-on-write page or out of physical memory.
+uint64
+cowcopy(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return 0;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcount((void*)pa) > 1){
+    if((mem = kalloc()) == 0)
+      return 0;
+    memmove(mem, (char*)pa, PGSIZE);
+    kfree((void*)pa);
+    pa = (uint64)mem;
+  }
+  // the TLB is flushed when returning to user space.
+  *pte = PA2PTE(pa) | flags;
+  return pa;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -336,6 +362,37 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// The last-level page-table page that a copy between user and
+// kernel walked to, and the region of address space it maps.
+// Later pages of the copy in that region need only index it.
+struct uwalk {
+  pagetable_t pt;
+  uint64 region;
+};
+
+// Return the PTE of the user page at va, like walkaddr(), but
+// using w to skip the upper levels of the walk where it can.
+// Returns 0 if va isn't mapped for user access.
+static pte_t*
+uwalk(pagetable_t pagetable, uint64 va, struct uwalk *w)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  if(w->pt && w->region == va >> PXSHIFT(1)){
+    pte = &w->pt[PX(0, va)];
+  } else {
+    if((pte = walk(pagetable, va, 0)) == 0)
+      return 0;
+    w->pt = (pagetable_t)PGROUNDDOWN((uint64)pte);
+    w->region = va >> PXSHIFT(1);
+  }
+  if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return 0;
+  return pte;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -344,23 +401,28 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
   pte_t *pte;
+  struct uwalk w = { 0 };
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
   
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+    if((pte = uwalk(pagetable, va0, &w)) == 0) {
+      if(vmfault(pagetable, va0, 0) == 0 ||
+         (pte = uwalk(pagetable, va0, &w)) == 0) {
         return -1;
       }
     }
+    pa0 = PTE2PA(*pte);
 
-    pte = walk(pagetable, va0, 0);
-    // forbid copyout over read-only user text pages.
-    if((*pte & PTE_W) == 0)
-      return -1;
+    // forbid copyout over read-only user text pages,
+    // but give the process its own copy of a
+    // copy-on-write page.
+    if((*pte & PTE_W) == 0){
+      if((*pte & PTE_COW) == 0 || (pa0 = cowcopy(pagetable, va0)) == 0)
+        return -1;
+    }
       
     n = PGSIZE - (dstva - va0);
     if(n > len)
@@ -381,14 +443,15 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
+  struct uwalk w = { 0 };
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
+    if((pte = uwalk(pagetable, va0, &w)) != 0) {
+      pa0 = PTE2PA(*pte);
+    } else if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+      return -1;
     }
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -409,46 +472,41 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 n, m, va0;
+  pte_t *pte;
+  struct uwalk w = { 0 };
+  char *p;
 
-  while(got_null == 0 && max > 0){
+  while(max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = uwalk(pagetable, va0, &w)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
+    // find the end of the string in this page, then copy it.
+    p = (char *) (PTE2PA(*pte) + (srcva - va0));
+    m = strnlen(p, n);
+    memmove(dst, p, m);
+    if(m < n){
+      dst[m] = '\0';
+      return 0;
     }
 
+    max -= n;
+    dst += n;
     srcva = va0 + PGSIZE;
   }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
-  }
+  return -1;
 }
 
 // allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
-// returns 0 if va is invalid or already mapped, or if
-// out of physical memory, and physical address if successful.
+// that was lazily allocated in sys_sbrk(), or copy a
+// copy-on-write page that the process is writing.
+// returns 0 if va is invalid or already mapped (and not
+// copy-on-write), or if out of physical memory, and physical
+// address if successful.
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
@@ -459,12 +517,13 @@ vmfault(pagetable_t pagetable, uint64 va, int read)
     return 0;
   va = PGROUNDDOWN(va);
   if(ismapped(pagetable, va)) {
-    return 0;
+    if(read)
+      return 0;
+    return cowcopy(pagetable, va);
   }
-  mem = (uint64) kalloc();
+  mem = (uint64) kalloc_zeroed();
   if(mem == 0)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
   if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
     kfree((void *)mem);
     return 0;
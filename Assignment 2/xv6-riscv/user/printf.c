@@ -1,15 +1,71 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 #include <stdarg.h>
 
 static char digits[] = "0123456789ABCDEF";
 
+// Output is collected in a buffer per fd and written with one
+// write() at the end of a printf that ended a line, when the
+// buffer fills, at fflush(), before fork(), exec() and exit(),
+// and before close() or dup() of its fd. Output to fd 2 is
+// written at the end of every printf, so prompts and errors
+// appear at once.
+#define PBUFSZ 256
+
+struct pbuf {
+  int n;      // bytes in buf
+  int nl;     // buf holds a newline
+  char buf[PBUFSZ];
+};
+static struct pbuf pbuf[NOFILE];
+
+// Write out what is buffered for fd.
+void
+fflush(int fd)
+{
+  struct pbuf *b;
+
+  if(fd < 0 || fd >= NOFILE)
+    return;
+  b = &pbuf[fd];
+  if(b->n > 0)
+    write(fd, b->buf, b->n);
+  b->n = 0;
+  b->nl = 0;
+}
+
+// Write out what is buffered for fd, or for every fd if
+// fd is -1; see printflush in ulib.c.
+static void
+flushfd(int fd)
+{
+  if(fd >= 0){
+    fflush(fd);
+    return;
+  }
+  for(fd = 0; fd < NOFILE; fd++)
+    fflush(fd);
+}
+
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  struct pbuf *b;
+
+  if(fd < 0 || fd >= NOFILE){
+    write(fd, &c, 1);
+    return;
+  }
+  b = &pbuf[fd];
+  if(b->n == PBUFSZ)
+    fflush(fd);
+  b->buf[b->n++] = c;
+  if(c == '\n')
+    b->nl = 1;
+  printflush = flushfd;
 }
 
 static void
@@ -111,6 +167,8 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+  if(fd == 2 || (fd >= 0 && fd < NOFILE && pbuf[fd].nl))
+    fflush(fd);
 }
 
 void
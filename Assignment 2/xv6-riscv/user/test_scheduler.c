@@ -1,12 +1,13 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/sched.h"
 #include "user/user.h"
 
 int
 main(int argc, char *argv[])
 {
-  if(argc != 2){
-    fprintf(2, "Usage: test_scheduler tickets\n");
+  if(argc != 2 && argc != 3){
+    fprintf(2, "Usage: test_scheduler tickets [lottery|stride]\n");
     exit(1);
   }
 
@@ -17,6 +18,23 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  // Optionally switch the scheduling policy
+  if(argc == 3){
+    int mode;
+    if(strcmp(argv[2], "stride") == 0)
+      mode = SCHED_STRIDE;
+    else if(strcmp(argv[2], "lottery") == 0)
+      mode = SCHED_LOTTERY;
+    else {
+      fprintf(2, "unknown policy %s\n", argv[2]);
+      exit(1);
+    }
+    if(setsched(mode) < 0){
+      fprintf(2, "setsched failed\n");
+      exit(1);
+    }
+  }
+
   // Set the ticket count for this process
   if(settickets(tickets) < 0){
     fprintf(2, "settickets failed\n");
@@ -5,6 +5,11 @@
 #include "kernel/vm.h"
 #include "user/user.h"
 
+// Set by printf.c while it holds output not yet written, so
+// that these wrappers can write it first: the output for fd,
+// or for every fd if fd is -1.
+void (*printflush)(int);
+
 //
 // wrapper so that it's OK if main() does not call exit().
 //
@@ -159,3 +164,45 @@ sbrklazy(int n) {
   return sys_sbrk(n, SBRK_LAZY);
 }
 
+int
+fork(void)
+{
+  // otherwise the child would print a copy of the output.
+  if(printflush)
+    printflush(-1);
+  return sys_fork();
+}
+
+int
+exec(const char *path, char **argv)
+{
+  if(printflush)
+    printflush(-1);
+  return sys_exec(path, argv);
+}
+
+int
+exit(int status)
+{
+  if(printflush)
+    printflush(-1);
+  sys_exit(status);
+}
+
+int
+close(int fd)
+{
+  // else the output would be lost, or go to the next file
+  // opened as fd.
+  if(printflush)
+    printflush(fd);
+  return sys_close(fd);
+}
+
+int
+dup(int fd)
+{
+  if(printflush)
+    printflush(fd);
+  return sys_dup(fd);
+}
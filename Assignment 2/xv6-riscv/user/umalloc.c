@@ -2,9 +2,17 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/param.h"
+#include "kernel/riscv.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Small requests are served from slabs: blocks of whole pages,
+// each cut into objects of one size class and keeping
+// a list of its free objects, so malloc() and free() of a
+// small object take constant time. Larger requests, and the
+// slabs themselves, come from the free list of the memory
+// allocator by Kernighan and Ritchie, The C programming
+// Language, 2nd ed.  Section 8.7, which coalesces freed
+// blocks and gives whole pages at the top of the heap back
+// to the kernel.
 
 typedef long Align;
 
@@ -18,15 +26,67 @@ union header {
 
 typedef union header Header;
 
+// Every block starts with a Header. A big block's s.size is
+// its size in Headers, including the header. A small object's
+// s.size is 0, and its s.ptr is its slab while it is in use
+// and the next free object of the slab while it is free.
+
+#define NCLASS   5      // object sizes 32, 64, ..., 512 bytes
+#define MINSMALL 32
+#define SLABOBJS 32     // objects a slab has room for, about
+#define TRIMSIZE (32*PGSIZE)  // free this much at the top to shrink
+
+struct slab {
+  struct slab *next;  // the class's slabs with free objects
+  struct slab *prev;
+  Header *free;       // free objects
+  int cls;            // size class
+  int nused;          // objects in use
+};
+
 static Header base;
 static Header *freep;
+static char *heaptop;  // end of the heap, as last set by us
+static struct slab *slabs[NCLASS];
 
-void
-free(void *ap)
+// Bytes in a slab of class cls: whole pages with the block's
+// header, enough for about SLABOBJS objects, so that the slab
+// header wastes little more than one object.
+static uint
+slabsize(int cls)
 {
-  Header *bp, *p;
+  uint npages = ((MINSMALL << cls) * SLABOBJS + PGSIZE - 1) / PGSIZE;
+
+  return npages * PGSIZE - sizeof(Header);
+}
+
+// Give the whole pages at the end of free block p back to the
+// kernel, if p is at the top of the heap and large enough.
+static void
+trim(Header *p)
+{
+  char *top;
+  uint n;
+
+  if(p->s.size * sizeof(Header) < TRIMSIZE + sizeof(Header))
+    return;
+  top = sbrk(0);
+  if((char*)(p + p->s.size) != top)
+    return;
+  n = (p->s.size - 1) * sizeof(Header) / PGSIZE * PGSIZE;
+  if(sbrk(-(int)n) == SBRK_ERROR)
+    return;
+  p->s.size -= n / sizeof(Header);
+  heaptop = top - n;
+}
+
+// Put big block bp on the free list, merging it with
+// its neighbours. Returns the merged free block.
+static Header*
+bigfree(Header *bp)
+{
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -38,9 +98,11 @@ free(void *ap)
   if(p + p->s.size == bp){
     p->s.size += bp->s.size;
     p->s.ptr = bp->s.ptr;
+    bp = p;
   } else
     p->s.ptr = bp;
   freep = p;
+  return bp;
 }
 
 static Header*
@@ -54,19 +116,19 @@ morecore(uint nu)
   p = sbrk(nu * sizeof(Header));
   if(p == SBRK_ERROR)
     return 0;
+  heaptop = p + nu * sizeof(Header);
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  bigfree(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+// Return a big block of nunits Headers, including its header.
+static Header*
+bigalloc(uint nunits)
 {
   Header *p, *prevp;
-  uint nunits;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +143,119 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
-      return (void*)(p + 1);
+      return p;
     }
     if(p == freep)
       if((p = morecore(nunits)) == 0)
         return 0;
   }
 }
+
+static void
+slablink(struct slab *sl)
+{
+  sl->prev = 0;
+  sl->next = slabs[sl->cls];
+  if(sl->next)
+    sl->next->prev = sl;
+  slabs[sl->cls] = sl;
+}
+
+static void
+slabunlink(struct slab *sl)
+{
+  if(sl->prev)
+    sl->prev->next = sl->next;
+  else
+    slabs[sl->cls] = sl->next;
+  if(sl->next)
+    sl->next->prev = sl->prev;
+}
+
+// Make a new slab for size class cls.
+static struct slab*
+slaballoc(int cls)
+{
+  Header *hp, *o;
+  struct slab *sl;
+  char *p, *end;
+  uint size = MINSMALL << cls;
+
+  if((hp = bigalloc(slabsize(cls) / sizeof(Header) + 1)) == 0)
+    return 0;
+  sl = (struct slab*)(hp + 1);
+  sl->cls = cls;
+  sl->nused = 0;
+  sl->free = 0;
+  end = (char*)sl + slabsize(cls);
+  p = (char*)sl + (sizeof(struct slab) + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header);
+  for(; p + size <= end; p += size){
+    o = (Header*)p;
+    o->s.size = 0;
+    o->s.ptr = sl->free;
+    sl->free = o;
+  }
+  slablink(sl);
+  return sl;
+}
+
+static void
+smallfree(Header *o)
+{
+  struct slab *sl = (struct slab*)o->s.ptr;
+
+  if(sl->free == 0)
+    slablink(sl);
+  o->s.ptr = sl->free;
+  sl->free = o;
+  // keep one slab with free objects, give back the others
+  // once empty, and that one too if it is at the top of the
+  // heap, where it would stop trim().
+  if(--sl->nused == 0 &&
+     (sl->prev || sl->next || (char*)sl + slabsize(sl->cls) == heaptop)){
+    slabunlink(sl);
+    trim(bigfree((Header*)sl - 1));
+  }
+}
+
+void
+free(void *ap)
+{
+  Header *bp;
+
+  bp = (Header*)ap - 1;
+  if(bp->s.size == 0)
+    smallfree(bp);
+  else
+    trim(bigfree(bp));
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *p;
+  struct slab *sl;
+  uint nunits;
+  int cls;
+
+  for(cls = 0; cls < NCLASS; cls++){
+    if(nbytes + sizeof(Header) <= MINSMALL << cls)
+      break;
+  }
+  if(cls < NCLASS){
+    if((sl = slabs[cls]) == 0 && (sl = slaballoc(cls)) == 0)
+      return 0;
+    p = sl->free;
+    sl->free = p->s.ptr;
+    p->s.ptr = (Header*)sl;
+    sl->nused++;
+    if(sl->free == 0)
+      slabunlink(sl);
+    return (void*)(p + 1);
+  }
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if((p = bigalloc(nunits)) == 0)
+    return 0;
+  return (void*)(p + 1);
+}
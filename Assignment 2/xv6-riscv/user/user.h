@@ -25,6 +25,14 @@ char* sys_sbrk(int,int);
 int pause(int);
 int uptime(void);
 int settickets(int);
+int setsched(int);
+int pipesize(int, int);
+int splice(int, int, int);
+int sys_fork(void);
+int sys_exit(int) __attribute__((noreturn));
+int sys_exec(const char*, char**);
+int sys_close(int);
+int sys_dup(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,10 +48,12 @@ int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 char* sbrk(int);
 char* sbrklazy(int);
+extern void (*printflush)(int);
 
 // printf.c
 void fprintf(int, const char*, ...) __attribute__ ((format (printf, 2, 3)));
 void printf(const char*, ...) __attribute__ ((format (printf, 1, 2)));
+void fflush(int);
 
 // umalloc.c
 void* malloc(uint);
@@ -578,10 +578,11 @@ writetest(char *s)
   }
 }
 
+// write n blocks to a new file and read them back.
 void
-writebig(char *s)
+writebig1(char *s, int n)
 {
-  int i, fd, n;
+  int i, fd, r;
 
   fd = open("big", O_CREATE|O_RDWR);
   if(fd < 0){
@@ -589,7 +590,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < n; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -605,25 +606,25 @@ writebig(char *s)
     exit(1);
   }
 
-  n = 0;
+  i = 0;
   for(;;){
-    i = read(fd, buf, BSIZE);
-    if(i == 0){
-      if(n != MAXFILE){
-        printf("%s: read only %d blocks from big", s, n);
+    r = read(fd, buf, BSIZE);
+    if(r == 0){
+      if(i != n){
+        printf("%s: read only %d blocks from big", s, i);
         exit(1);
       }
       break;
-    } else if(i != BSIZE){
-      printf("%s: read failed %d\n", s, i);
+    } else if(r != BSIZE){
+      printf("%s: read failed %d\n", s, r);
       exit(1);
     }
-    if(((int*)buf)[0] != n){
+    if(((int*)buf)[0] != i){
       printf("%s: read content of block %d is %d\n", s,
-             n, ((int*)buf)[0]);
+             i, ((int*)buf)[0]);
       exit(1);
     }
-    n++;
+    i++;
   }
   close(fd);
   if(unlink("big") < 0){
@@ -632,6 +633,93 @@ writebig(char *s)
   }
 }
 
+// a file just past the single-indirect range.
+void
+writebig(char *s)
+{
+  writebig1(s, NDIRECT + NINDIRECT + 10);
+}
+
+// a file of MAXFILE blocks, as many as a classic inode maps.
+void
+writemax(char *s)
+{
+  writebig1(s, MAXFILE);
+}
+
+// grow a directory, which keeps a classic block list, to
+// more than nblocks blocks with links to one file, look up
+// each name, and take it all apart again.
+void
+bigdir1(char *s, int nblocks)
+{
+  int i, fd, n;
+  char name[16];
+  struct stat st;
+  uint ino;
+
+  n = nblocks * (BSIZE / sizeof(struct dirent));
+  mkdir("cd");
+  fd = open("cd/f", O_CREATE|O_RDWR);
+  if(fd < 0 || fstat(fd, &st) < 0){
+    printf("%s: cannot create cd/f\n", s);
+    exit(1);
+  }
+  close(fd);
+  ino = st.ino;
+
+  strcpy(name, "cd/x00000");
+  for(i = 0; i < n; i++){
+    name[4] = '0' + i / 10000;
+    name[5] = '0' + i / 1000 % 10;
+    name[6] = '0' + i / 100 % 10;
+    name[7] = '0' + i / 10 % 10;
+    name[8] = '0' + i % 10;
+    if(link("cd/f", name) != 0){
+      printf("%s: link(cd/f, %s) failed\n", s, name);
+      exit(1);
+    }
+  }
+  // ., .., f and the links.
+  if(stat("cd", &st) < 0 || st.size != (n + 3) * sizeof(struct dirent)){
+    printf("%s: cd has the wrong size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    name[4] = '0' + i / 10000;
+    name[5] = '0' + i / 1000 % 10;
+    name[6] = '0' + i / 100 % 10;
+    name[7] = '0' + i / 10 % 10;
+    name[8] = '0' + i % 10;
+    if(stat(name, &st) < 0 || st.ino != ino){
+      printf("%s: %s not found\n", s, name);
+      exit(1);
+    }
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("cd/f") != 0 || unlink("cd") != 0){
+    printf("%s: cannot remove cd\n", s);
+    exit(1);
+  }
+}
+
+// a directory just past its direct blocks.
+void
+dirindirect(char *s)
+{
+  bigdir1(s, NDIRECT + 1);
+}
+
+// a directory in the double-indirect range.
+void
+dirdindirect(char *s)
+{
+  bigdir1(s, NDIRECT + NINDIRECT + 1);
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -788,6 +876,85 @@ pipe1(char *s)
   }
 }
 
+// move a file through a pipe into another file with splice()
+void
+splicetest(char *s)
+{
+  int fds[2], fd, pid, xstatus;
+  int i, n, total;
+  enum { SZ=10000 };
+
+  fd = open("splicein", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create splicein failed\n", s);
+    exit(1);
+  }
+  for(total = 0; total < SZ; total += n){
+    n = SZ - total < BUFSZ ? SZ - total : BUFSZ;
+    for(i = 0; i < n; i++)
+      buf[i] = (total + i) * 7;
+    if(write(fd, buf, n) != n){
+      printf("%s: write splicein failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("splicein", O_RDONLY);
+    if(splice(fd, fds[1], SZ) != SZ){
+      printf("%s: splice into pipe failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  fd = open("spliceout", O_CREATE|O_RDWR);
+  total = 0;
+  while((n = splice(fds[0], fd, SZ)) > 0)
+    total += n;
+  close(fds[0]);
+  close(fd);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(n < 0 || total != SZ){
+    printf("%s: splice out of pipe moved %d\n", s, total);
+    exit(1);
+  }
+
+  fd = open("spliceout", O_RDONLY);
+  for(total = 0; (n = read(fd, buf, BUFSZ)) > 0; total += n){
+    for(i = 0; i < n; i++){
+      if((buf[i] & 0xff) != (((total + i) * 7) & 0xff)){
+        printf("%s: wrong data at %d\n", s, total + i);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  if(total != SZ){
+    printf("%s: spliceout has %d bytes\n", s, total);
+    exit(1);
+  }
+  if(splice(fds[0], fds[1], 1) >= 0){
+    printf("%s: splice of closed fds succeeded\n", s);
+    exit(1);
+  }
+  unlink("splicein");
+  unlink("spliceout");
+}
+
 
 // test if child is killed (status = -1)
 void
@@ -2767,10 +2934,12 @@ struct test {
   {opentest, "opentest"},
   {writetest, "writetest"},
   {writebig, "writebig"},
+  {dirindirect, "dirindirect"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
+  {splicetest, "splicetest"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -3073,6 +3242,61 @@ diskfull(char *s)
   }
 }
 
+// write and read back a multi-megabyte file, reporting
+// how long each takes.
+void
+bigfilebench(char *s)
+{
+  enum { SZ = 8*BSIZE, N = 1024 };  // 8 MB
+  int fd, i, j, t0, t1, t2;
+
+  unlink("bigbench");
+  fd = open("bigbench", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create bigbench\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  for(i = 0; i < N; i++){
+    for(j = 0; j < SZ/BSIZE; j++)
+      ((int*)buf)[j*BSIZE/sizeof(int)] = i*(SZ/BSIZE) + j;
+    if(write(fd, buf, SZ) != SZ){
+      printf("%s: write bigbench failed i=%d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  t1 = uptime();
+  fd = open("bigbench", O_RDONLY);
+  if(fd < 0){
+    printf("%s: cannot open bigbench\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, SZ) != SZ){
+      printf("%s: read bigbench failed i=%d\n", s, i);
+      exit(1);
+    }
+    for(j = 0; j < SZ/BSIZE; j++){
+      if(((int*)buf)[j*BSIZE/sizeof(int)] != i*(SZ/BSIZE) + j){
+        printf("%s: bigbench block %d has wrong data\n", s, i*(SZ/BSIZE) + j);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd, buf, SZ) != 0){
+    printf("%s: bigbench too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  t2 = uptime();
+  unlink("bigbench");
+
+  printf("%s: %d KB: write %d ticks, read %d ticks\n",
+         s, N*SZ/1024, t1 - t0, t2 - t1);
+}
+
 void
 outofinodes(char *s)
 {
@@ -3111,7 +3335,10 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
-    
+  {bigfilebench, "bigfilebench"},
+  {writemax, "writemax"},
+  {dirdindirect, "dirdindirect"},
+
   { 0, 0},
 };
 
@@ -6,10 +6,13 @@ print "# generated by usys.pl - do not edit\n";
 
 print "#include \"kernel/syscall.h\"\n";
 
+# ulib.c wraps these, so their stubs are named sys_<name>.
+my %wrapped = map { $_ => 1 } qw(fork exit exec close dup sbrk);
+
 sub entry {
     my $prefix = "sys_";
     my $name = shift;
-    if ($name eq "sbrk") {
+    if ($wrapped{$name}) {
 	print ".global $prefix$name\n";
 	print "$prefix$name:\n";
     } else {
@@ -43,3 +46,6 @@ entry("sbrk");
 entry("pause");
 entry("uptime");
 entry("settickets");
+entry("setsched");
+entry("pipesize");
+entry("splice");